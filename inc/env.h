@@ -41,9 +41,13 @@ enum {
     ENV_RUNNING,
     ENV_WAITING,
     ENV_WAITING_SWAP,
-    ENV_NOT_RUNNABLE
+    ENV_NOT_RUNNABLE,
+    ENV_TEMPLATE            /* Frozen, only used to start children from */
 };
 
+/* Default stack_limit of user environments */
+#define ENV_STACK_LIMIT (8 * 1024 * 1024)
+
 /* Special environment types */
 enum env_type {
     ENV_TYPE_USER = 0,
@@ -51,6 +55,36 @@ enum env_type {
     ENV_TYPE_KERNEL_THREAD,
 };
 
+/* Scheduling priority range (sys_set_priority) */
+#define NICE_MIN    -20
+#define NICE_MAX    19
+
+/* Earliest deadline first class (kern/sched.c), period is 0 for fair envs.
+ * Times are TSC cycles. */
+struct env_rt {
+    uint64_t runtime;           /* Budget per period */
+    uint64_t period;
+    uint64_t deadline;          /* End of the current period (TSC) */
+    uint64_t budget;            /* Left in the current period */
+    uint32_t util;              /* runtime / period, permille */
+    int cpu;                    /* CPU the env was admitted to */
+    struct env *next;           /* EDF list of that CPU's run queue */
+    uint32_t periods;           /* Periods started */
+    uint32_t misses;            /* Periods that ended while runnable with budget left */
+};
+
+/* CPU usage of an env (sys_getrusage), times are TSC cycles */
+struct rusage {
+    uint64_t ru_utime;          /* In user mode */
+    uint64_t ru_stime;          /* In the kernel: syscalls, faults, scheduling */
+    uint64_t ru_swaptime;       /* Blocked until a page was swapped in */
+    uint32_t ru_nvcsw;          /* Gave up the CPU: blocked or sys_yield */
+    uint32_t ru_nivcsw;         /* Preempted at the end of its slice (budget) */
+    uint32_t ru_faults[PAGEFAULT_TYPE_COUNT];   /* Page faults by type */
+};
+
+struct waitqueue;
+
 typedef struct env {
     struct trapframe env_tf;    /* Saved registers */
     struct env *env_link;       /* Next free env */
@@ -61,7 +95,21 @@ typedef struct env {
     uint32_t env_runs;          /* Number of times environment has run */
     int env_cpunum;             /* The CPU that the env is running on */
     uint32_t remain_cpu_time;
-    envid_t waiting_for;
+    int env_rq;                 /* Run queue cpu + 1, 0 if not queued */
+    uint32_t env_rq_idx;        /* Slot in the run queue heap (kern/sched.c) */
+    int env_nice;               /* NICE_MIN .. NICE_MAX, lower is more CPU */
+    uint32_t env_weight;        /* Share of CPU time, from env_nice */
+    uint64_t env_vruntime;      /* CPU time used, scaled by weight */
+    struct env_rt env_rt;       /* Real-time reservation, if any */
+    uint32_t env_affinity;      /* Bit per CPU the env may run on */
+    uint32_t env_migrations;    /* Times it ran on another CPU than before */
+    struct rusage env_rusage;   /* CPU accounting, see env_charge */
+    uint64_t env_charged;       /* TSC up to which env_rusage is charged */
+    struct waitqueue *env_waitq;    /* Queue the env is blocked on (kern/waitqueue.h) */
+    struct env *env_wait_next;      /* Next env blocked on it */
+    uint32_t stack_limit;       /* Max size of grow-down (stack) vma's */
+    envid_t vfork_parent;       /* Owner of the borrowed address space (vfork), 0 if own */
+    envid_t vfork_child;        /* Env borrowing our address space (vfork), 0 if none */
 
     /* Address space */
     pde_t *env_pgdir;           /* Kernel virtual address of page dir */
@@ -44,12 +44,29 @@ envid_t sys_getenvid(void);
 int sys_env_destroy(envid_t);
 void *sys_vma_create(size_t size, int perm, int flags);
 int sys_vma_destroy(void *va, size_t size);
+int sys_vma_protect(void *va, size_t size, int perm);
+int sys_vma_advise(void *va, size_t size, int advice);
+int sys_shm_create(size_t size);
+void *sys_shm_map(int id, int perm);
+int sys_shm_destroy(int id);
+void *sys_vma_disk_map(uint32_t offset, size_t size, int perm);
+int sys_vma_sync(void *va, size_t size);
 void    sys_yield(void);
 int     sys_wait(envid_t);
 envid_t sys_fork(void);
+envid_t sys_spawn(const char *name, const char **argv);
+envid_t sys_vfork(void);
+int sys_exec(const char *name, const char **argv);
+envid_t sys_template_create(void);
+envid_t sys_template_spawn(envid_t id);
+int sys_set_priority(envid_t envid, int nice);
+int sys_set_realtime(uint32_t runtime, uint32_t period);
+int sys_set_affinity(envid_t envid, uint32_t mask);
+int sys_getrusage(envid_t envid, struct rusage *ru);
 
 /* fork.c */
 envid_t fork(void);
+envid_t template_create(void);
 
 /* File open modes */
 #define O_RDONLY    0x0000      /* open for reading only */
@@ -65,8 +82,17 @@ envid_t fork(void);
 /* Virtual Memory Area permissions */
 #define PERM_R	    0x0001
 #define PERM_W	    0x0002
+#define PERM_X	    0x0004
 
 /* Virtual Memory Area flags */
 #define MAP_POPULATE    0x0001
 
+/* Virtual Memory Area advice */
+#define MADV_NORMAL     0
+#define MADV_SEQUENTIAL 1
+#define MADV_RANDOM     2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+#define MADV_FREE       5
+
 #endif  /* !JOS_INC_LIB_H */
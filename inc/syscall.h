@@ -11,6 +11,22 @@ enum {
     SYS_yield,
     SYS_wait,
     SYS_fork,
+    SYS_vma_protect,
+    SYS_vma_advise,
+    SYS_shm_create,
+    SYS_shm_map,
+    SYS_shm_destroy,
+    SYS_vma_disk_map,
+    SYS_vma_sync,
+    SYS_spawn,
+    SYS_vfork,
+    SYS_exec,
+    SYS_template_create,
+    SYS_template_spawn,
+    SYS_set_priority,
+    SYS_set_realtime,
+    SYS_set_affinity,
+    SYS_getrusage,
     NSYSCALLS
 };
 
@@ -38,11 +38,28 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20      /* IPI: run queue of a halted CPU got work */
 
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
 
+/* Page fault types, how the kernel classified a fault (kern/trap.c) */
+enum {
+    PAGEFAULT_TYPE_NONE = 0,
+    PAGEFAULT_TYPE_KERNEL,
+    PAGEFAULT_TYPE_OUTSIDE_USER_RANGE,
+    PAGEFAULT_TYPE_NO_VMA,
+    PAGEFAULT_TYPE_UNUSED_VMA,
+    PAGEFAULT_TYPE_INVALID_PERMISSION,
+    PAGEFAULT_TYPE_COW,
+    PAGEFAULT_TYPE_FILEBACKED,
+    PAGEFAULT_TYPE_NO_PTE,
+    PAGEFAULT_TYPE_SWAP,
+    PAGEFAULT_TYPE_NO_MEMORY,
+    PAGEFAULT_TYPE_COUNT
+};
+
 struct pushregs {
     /* registers as pushed by pusha */
     uint32_t reg_edi; //0
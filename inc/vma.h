@@ -7,7 +7,8 @@
 
 /*  VMA helpers */
 /* Anonymous VMAs are zero-initialized whereas binary VMAs
- * are filled-in from the ELF binary.
+ * are filled-in from the ELF binary. Shared VMAs map the pages of a
+ * shared object, writable in every env and never copied on write.
  */
 #define VMA_ARRAY_SIZE 128
 #define VMA_UVA 0xE0000000
@@ -18,6 +19,11 @@
 #define VMA_INVALID_INDEX (uint8_t)0xFFFF
 
 #define VMA_FLAG_POPULATE 0x1
+/* Stack vma, its lower bound extends on faults just below it */
+#define VMA_FLAG_GROWSDOWN 0x2
+
+/* Unmapped pages kept between a grow-down vma and the vma below it */
+#define VMA_STACK_GUARD_GAP (16 * PGSIZE)
 
 /* VMA error codes */
 enum {
@@ -34,6 +40,21 @@ enum {
     VMA_UNUSED,
     VMA_ANON,
     VMA_BINARY,
+    VMA_SHARED,
+};
+
+/*
+ * Access pattern advice (madvise)
+ *  NORMAL, SEQUENTIAL and RANDOM are stored in the vma and steer fault-around,
+ *  readahead and eviction. WILLNEED, DONTNEED and FREE act once on the range.
+ */
+enum {
+    VMA_ADVICE_NORMAL = 0,
+    VMA_ADVICE_SEQUENTIAL,
+    VMA_ADVICE_RANDOM,
+    VMA_ADVICE_WILLNEED,
+    VMA_ADVICE_DONTNEED,
+    VMA_ADVICE_FREE,
 };
 
 typedef struct vma {
@@ -48,8 +69,13 @@ typedef struct vma {
      * This is to support file backing outside allignment
      */
     uint16_t backed_start_offset;//14
+    uint8_t advice;//15 VMA_ADVICE_NORMAL, _SEQUENTIAL or _RANDOM
+    uint8_t flags;//16 VMA_FLAG_GROWSDOWN
+    /* Kernel backing memory, for VMA_SHARED the shared object (kern/shm.h) */
     void * backed_addr;
     uint32_t backsize;
+    /* VMA_SHARED: byte offset of va into the shared object */
+    uint32_t offset;
     
     /* LAB 4: You may add more fields here, if required. */
 } vma_t;
@@ -27,6 +27,8 @@ struct cpuinfo {
     volatile unsigned cpu_status;  /* The status of the CPU */
     struct env *cpu_env;           /* The currently-running environment. */
     struct taskstate cpu_ts;       /* Used by x86 to find stack for interrupt */
+    uint32_t cpu_tsc_khz;          /* TSC rate, calibrated by lapic_init */
+    uint32_t cpu_lapic_khz;        /* LAPIC timer rate (divide by 1) */
 };
 
 /* Initialized in mpconfig.c */
@@ -48,7 +50,10 @@ void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
+void lapic_timer_arm(uint64_t cycles);
+void lapic_timer_disarm(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
 
 #endif //assembler
 
@@ -13,12 +13,15 @@
 
 #include "env.h"
 #include "vma.h"
+#include "swappy.h"
 #include "cpu.h"
 #include "pmap.h"
 #include "trap.h"
 #include "sched.h"
+#include "waitqueue.h"
 #include "monitor.h"
 #include "spinlock.h"
+#include "shm.h"
 #include "inc/atomic_ops.h"
 
 struct env *envs = NULL;            /* All environments */
@@ -271,6 +274,12 @@ int env_alloc(struct env **newenv_store, envid_t parent_id, enum env_type envtyp
     e->env_status = ENV_NOT_RUNNABLE; //Not initialized so not runnable!
     e->env_runs = 0;
     e->remain_cpu_time = MAX_TIME_SLICE;
+    e->env_vruntime = 0;
+    sched_set_nice(e, 0);
+    memset(&e->env_rt, 0, sizeof(e->env_rt));
+    e->env_affinity = ~0U;
+    e->env_migrations = 0;
+    e->stack_limit = ENV_STACK_LIMIT;
 
     /*
      * Clear out all the saved register state, to prevent the register values of
@@ -332,109 +341,6 @@ int env_alloc(struct env **newenv_store, envid_t parent_id, enum env_type envtyp
     return 0;
 }
 
-/*
- * Allocate len bytes of physical memory for environment env, and map it at
- * virtual address va in the environment's address space.
- * Does not zero or otherwise initialize the mapped pages in any way.
- * Pages should be writable by user and kernel.
- * Panic if any allocation attempt fails.
- */
-static void region_alloc(struct env *e, void *va, size_t len)
-{
-    /*
-     * LAB 3: Your code here.
-     * (But only if you need it for load_icode.)
-     *
-     * Hint: It is easier to use region_alloc if the caller can pass
-     *   'va' and 'len' values that are not page-aligned.
-     *   You should round va down, and round (va + len) up.
-     *   (Watch out for corner-cases!)
-     */
-    //Set print header
-    dprintf("region_alloc: %#08x to %#08x\n", va, va+len);
-
-    //Assertions
-    assert(len>0);
-    assert(e);
-
-    /* Bootstrap */
-    //rounded down virtual address
-    uint32_t rva = ((uint32_t) va ) & ~0xFFF; //bit mask lower bits to round down
-    //ROunded up length
-    size_t rlen = ROUNDUP(len, PGSIZE);
-    //number of physical pages to allocate
-    uint32_t numpages = rlen/PGSIZE;
-
-    /* Allocate */
-    //Allocated start page
-    dprintf("\tAllocating %d pages... \n", numpages);
-    struct page_info * pp = alloc_consecutive_pages(numpages,  0);
-    dprintf("Success!\n");
-
-    //TODO: try allocating separate pages if consecutive does not succeed
-    //assert allocation successful
-    assert(pp);
-
-    /* Page table determination */
-    //Determine amount of page table entries required
-    uint32_t pages4M, pages4K;
-    //Determine 4K pages in total
-    pages4K = numpages;
-    //Determine number of 4M pages in total
-    pages4M = pages4K / 1024;
-
-    // --------------- Remove 4M support --------------- //
-    pages4M = 0;
-
-    /* setup va tables */
-    dprintf("\tSetting up %u 4M and %u 4K pages at %#08x to %#08x... \n",
-    pages4M, pages4K-pages4M*1024, rva, rva+rlen);
-
-    uint32_t i = 0;
-    uint32_t res = 0;
-    for(; i<pages4M; i++)
-        res |= page_insert(
-                e->env_pgdir, //the env pgdir
-                pp+(i*1024), //origin address of pp + offset 4M pages
-                (void*)(rva + (i*1024*PGSIZE)),
-                PDE_BIT_HUGE | PDE_BIT_RW | PDE_BIT_USER | PDE_BIT_PRESENT
-                );
-    //Convert i * 4M pages to i * 4K pages
-    i *= 1024;
-
-    //i == number of 4k pages mapped via 4M, iterate till all leftovers are done
-    for(; i<pages4K; i++)
-        res |= page_insert(
-                    e->env_pgdir, //the env pgdir
-                    pp+i, //origin address of pp + offset 4M pages
-                    (void*)(rva + (i*PGSIZE)),
-                    PDE_BIT_RW | PDE_BIT_USER | PDE_BIT_PRESENT
-                    );
-
-    //Check if there where any errors
-    assert(res==0);
-    dprintf("Success!\n");
-
-    /* Check virtual pages */
-    dprintf("\tChecking access (R/W) to va range... \n");
-
-    //Create 32 bit sized bites (volatile hack to prevent optimizations)
-    volatile uint32_t * data;
-    //Print Check variables
-
-    //Check RW access to virtual memory
-    for(data=(uint32_t*)va; data<(uint32_t*)(va+len); data++) {
-        volatile uint32_t tmp = *data; //volatile prevents optimization
-        *data = tmp;
-    }
-    //If no pagefault happend, check succes!
-    dprintf("Successful!\n");
-
-    /* Invalidate TLB */
-    //Legacy code if lcr3 changes, keep this line!
-    tlb_invalidate(e->env_pgdir, va);
-}
-
 /*
  * Set up the initial program binary, stack, and processor flags for a user
  * process.
@@ -489,10 +395,6 @@ static void load_icode(struct env *e, uint8_t *binary)
 
     /* LAB 3: Your code here. */
 
-    /* Now map one page for the program's initial stack at virtual address
-     * USTACKTOP - PGSIZE. */
-//    region_alloc(e, (void*)(USTACKTOP - PGSIZE), PGSIZE);
-
     /* LAB 3: Your code here. */
     struct elf *elf_header = (struct elf *)binary;
     assert(elf_header->e_magic == ELF_MAGIC);
@@ -512,31 +414,25 @@ static void load_icode(struct env *e, uint8_t *binary)
             assert(ph->p_memsz >= ph->p_filesz);
             assert(ph->p_va + ph->p_memsz <= UTOP);
 
-            /* VMA mapping */
+            /* VMA mapping with the segment permissions */
             int perm = 0;
-//            perm |= ph->p_flags & ELF_PROG_FLAG_EXEC  ? VMA_PERM_EXEC  : 0;
-//            perm |= ph->p_flags & ELF_PROG_FLAG_WRITE ? VMA_PERM_WRITE : 0;
-//            perm |= ph->p_flags & ELF_PROG_FLAG_READ  ? VMA_PERM_READ  : 0;
-            perm = VMA_PERM_WRITE | VMA_PERM_READ | VMA_PERM_EXEC;
+            perm |= ph->p_flags & ELF_PROG_FLAG_EXEC  ? VMA_PERM_EXEC  : 0;
+            perm |= ph->p_flags & ELF_PROG_FLAG_WRITE ? VMA_PERM_WRITE : 0;
+            perm |= ph->p_flags & ELF_PROG_FLAG_READ  ? VMA_PERM_READ  : 0;
             int vma_index = vma_new(e, (void*)ph->p_va, ph->p_memsz, perm, VMA_BINARY); //elf binary
+            if (vma_index < 0)
+                panic("load_icode: segment at %p overlaps another segment", ph->p_va);
 
-            /* Set vma backing */
-//            vma_set_backing(e, vma_index, binary + ph->p_offset, ph->p_filesz);
-
+            /*
+             * Back the vma by the embedded image, pages are filled on first
+             * touch. Everything past p_filesz (bss) reads as zero.
+             */
+            if (ph->p_filesz)
+                vma_set_backing(e, vma_index, binary + ph->p_offset, ph->p_filesz);
 
             /* set end of code space variable*/
             if (ph->p_va+ph->p_memsz > eoc_mem)
                 eoc_mem = ph->p_va+ph->p_memsz;
-
-            /* Allocate region (prevents fault OD allocations) */
-            /* We may not allocate code region like this, it implies write permissions */
-            region_alloc(e, (void *)ph->p_va, ph->p_memsz);
-
-            /* We can use virtual addresses because the uenv's pgdir has been loaded */
-            memcpy((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-
-            /* Zero out remaining bytes */
-            memset((void *)ph->p_va + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
         }
 
     /* Add ELF entry to environment's instruction pointer */
@@ -550,7 +446,7 @@ static void load_icode(struct env *e, uint8_t *binary)
     vma_new(e, UTEMP+PGSIZE, PGSIZE, VMA_PERM_READ | VMA_PERM_WRITE, VMA_ANON);
 
     /* General (anon) mappings */
-    vma_new(e, (void*)(USTACKTOP-PGSIZE), PGSIZE, VMA_PERM_READ | VMA_PERM_WRITE, VMA_ANON); //stack
+    vma_new_stack(e, (void*)USTACKTOP, PGSIZE, VMA_PERM_READ | VMA_PERM_WRITE); //stack, grows on use
     /* Map end of code to stack as heap. Stack and heap get merged */
 //    vma_new(e, (void*)(eoc_mem + PGSIZE), 4<<20, VMA_PERM_READ | VMA_PERM_WRITE, VMA_ANON); //heap
 
@@ -583,29 +479,67 @@ void env_create(uint8_t *binary, enum env_type type)
     load_icode(e, binary); //also setups env registers (such SP and IP)
 
     /* Now its runnable, mark it as such */
-    if (sync_bool_compare_and_swap(&e->env_status, ENV_NOT_RUNNABLE, ENV_RUNNABLE) == 0)
-        panic("Set runnable failed!");
+    assert(e->env_status == ENV_NOT_RUNNABLE);
+    sched_wakeup(e);
 
     dprintf("Created env #%d at elf address %p\n", e - envs, binary);
 }
 
 /*
- * Frees env e and all memory it uses.
+ * Looks up the embedded binary 'name', 0 if there is none.
  */
-void env_free(struct env *envp)
+static uint8_t *env_binary(const char *name)
 {
-    /* Static so that we can enter env_free from kernel threads
-     * from their own stack, without faulting because their stacks
-     * are being freed as this method goes on. */
+    int i;
+
+    for (i = 0; i < nbinfiles; i++)
+        if (strcmp(binfiles[i].name, name) == 0)
+            return binfiles[i].binary;
+    return 0;
+}
+
+/*
+ * Allocates a new env and loads the embedded binary 'name' into it with
+ * load_icode, nothing of the parent is copied.
+ * The env is left ENV_NOT_RUNNABLE, so the caller can finish its setup.
+ *
+ * Returns 0 on success, < 0 on failure.  Errors include:
+ *  -E_INVAL if no binary is called 'name'
+ *  the errors of env_alloc
+ */
+int env_spawn(struct env **newenv_store, envid_t parent_id, const char *name)
+{
+    uint8_t *binary;
+    int r;
+
+    if (!(binary = env_binary(name)))
+        return -E_INVAL;
+
+    if ((r = env_alloc(newenv_store, parent_id, ENV_TYPE_USER)) < 0)
+        return r;
+
+    (*newenv_store)->env_type = ENV_TYPE_USER;
+    load_icode(*newenv_store, binary);
+
+    dprintf("Spawned env #%d from %s\n", *newenv_store - envs, name);
+    return 0;
+}
+
+/*
+ * Frees the address space of env e: its vmas, all mapped pages, the page
+ * tables and the page directory.
+ */
+static void env_free_vm(struct env *envp)
+{
+    /* Static for the same reason as in env_free */
     static struct env *e;
-    static pte_t *pt;
-    static uint32_t pdeno, pteno;
+    static uint32_t pdeno;
     static physaddr_t pa;
 
     e = envp;
 
-    /* Note the environment's demise. */
-    cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+    /* Tables shared with a fork relative are not ours to clean */
+    pgtable_release_shared(e->env_pgdir);
 
     /* Clean vmas */
     vma_array_destroy(e);
@@ -640,13 +574,13 @@ void env_free(struct env *envp)
         for(uint32_t i = 0; i<1024; i++) {
             pte_t pte = table[i];
 
-            /* Only decref present user pages */
+            /* Decref present pages, protected (PROT_NONE) pages lack the user bit */
             if (pte & PTE_BIT_PRESENT) {
-                if (pte & PTE_BIT_USER) {
-                    page_info_t *usr_page = pa2page(PTE_GET_PHYS_ADDRESS(pte));
+                page_info_t *usr_page = pa2page(PTE_GET_PHYS_ADDRESS(pte));
+                if (!usr_page->c0.reg.kernelPage)
                     page_decref(usr_page);
-                }
-            }
+            } else if (PTE_GET_PHYS_ADDRESS(pte))
+                swappy_drop_swapped(pte);
 
         }
 
@@ -664,7 +598,210 @@ void env_free(struct env *envp)
     /* Free the page directory */
     pa = PADDR(e->env_pgdir);
     e->env_pgdir = 0;
+    e->vma_list = 0;
     page_decref(pa2page(pa));
+}
+
+/*
+ * Guards the vfork_parent/vfork_child links, which decide who frees a
+ * borrowed address space: the parent, or the child once the parent was
+ * freed first (it is handed over then).
+ */
+static struct spinlock vfork_lock;
+
+/*
+ * Allocates a new env which runs on the address space of parent: it uses the
+ * parent's page directory and vma list instead of its own, and starts at the
+ * parent's registers. Nothing is copied or write protected.
+ * The env is left ENV_NOT_RUNNABLE, the caller must keep the parent from
+ * running until the child execs or exits. If the parent is freed before,
+ * the child inherits the address space.
+ *
+ * Returns 0 on success, < 0 on failure.  Errors include:
+ *  the errors of env_alloc
+ */
+int env_vfork(struct env **newenv_store, struct env *parent)
+{
+    struct env *e;
+    int r;
+
+    if ((r = env_alloc(&e, parent->env_id, ENV_TYPE_USER)) < 0)
+        return r;
+
+    env_free_vm(e);
+    e->env_pgdir = parent->env_pgdir;
+    e->vma_list = parent->vma_list;
+    e->vfork_parent = parent->env_id;
+    parent->vfork_child = e->env_id;
+
+    e->env_tf = parent->env_tf;
+    e->env_type = parent->env_type;
+    e->stack_limit = parent->stack_limit;
+
+    *newenv_store = e;
+    return 0;
+}
+
+/**
+ * Ends the borrowing of vfork child e, unless its parent was freed already
+ * and handed the address space over.
+ * @param e env, vfork child or not
+ * @return the parent, which owns the address space, 0 if e owns it
+ */
+static struct env *env_vfork_release(struct env *e)
+{
+    struct env *parent = 0;
+
+    spin_lock(&vfork_lock);
+    if (e->vfork_parent) {
+        parent = &envs[ENVX(e->vfork_parent)];
+        assert(parent->env_id == e->vfork_parent && parent->vfork_child == e->env_id);
+        parent->vfork_child = 0;
+        e->vfork_parent = 0;
+    }
+    spin_unlock(&vfork_lock);
+
+    return parent;
+}
+
+/*
+ * Replaces the image of env e by the embedded binary 'name', loaded as
+ * env_spawn does. 'stack' is mapped as the first stack page and e continues
+ * at the entry of the binary with its stack pointer at 'esp'.
+ * The old address space is freed. A vfork child hands it back to its
+ * parent instead, which resumes.
+ *
+ * Returns 0 on success, < 0 on failure, e is unchanged then.  Errors include:
+ *  -E_INVAL if no binary is called 'name'
+ *  -E_NO_MEM on memory exhaustion
+ */
+int env_exec(struct env *e, const char *name, struct page_info *stack, uintptr_t esp)
+{
+    pde_t *old_pgdir = e->env_pgdir;
+    vma_arr_t *old_vmas = e->vma_list;
+    pde_t *new_pgdir;
+    vma_arr_t *new_vmas;
+    uint8_t *binary;
+    struct env *parent;
+
+    if (!(binary = env_binary(name)))
+        return -E_INVAL;
+
+    /* Build the new address space next to the old one */
+    e->env_pgdir = 0;
+    e->vma_list = 0;
+    if (env_setup_vm(e) < 0)
+        goto fail;
+    if (vma_array_init(e) || page_insert(e->env_pgdir, stack,
+            (void *) (USTACKTOP - PGSIZE), PTE_BIT_PRESENT | PTE_BIT_RW | PTE_BIT_USER)) {
+        env_free_vm(e);
+        goto fail;
+    }
+
+    load_icode(e, binary);
+    memset(&e->env_tf.tf_regs, 0, sizeof(e->env_tf.tf_regs));
+    e->env_tf.tf_esp = esp;
+
+    /* Let go of the old one */
+    if ((parent = env_vfork_release(e))) {
+        wake_up_env(env_exit_waitqueue(e->env_id), parent);
+    } else {
+        new_pgdir = e->env_pgdir;
+        new_vmas = e->vma_list;
+        e->env_pgdir = old_pgdir;
+        e->vma_list = old_vmas;
+        env_free_vm(e);
+        e->env_pgdir = new_pgdir;
+        e->vma_list = new_vmas;
+    }
+
+    if (e == curenv)
+        lcr3(PADDR(e->env_pgdir));
+
+    dprintf("Env #%d now runs %s\n", e - envs, name);
+    return 0;
+
+fail:
+    e->env_pgdir = old_pgdir;
+    e->vma_list = old_vmas;
+    if (e == curenv)
+        lcr3(PADDR(old_pgdir));
+    return -E_NO_MEM;
+}
+
+/* Envs blocked until the env in the slot exits (sys_wait) or lets go of a
+ * vfork parent, one queue per envs[] slot */
+static struct waitqueue env_exit_wqs[NENV];
+
+struct waitqueue *env_exit_waitqueue(envid_t envid)
+{
+    return &env_exit_wqs[ENVX(envid)];
+}
+
+/**
+ * Frees the templates (sys_template_create) of an env that is being freed,
+ * nobody else may spawn from or destroy them
+ * @param parent envid of the creator
+ */
+static void env_free_templates(envid_t parent)
+{
+    struct env *t;
+
+    for (t = envs; t < envs + NENV; t++)
+        if (t->env_status == ENV_TEMPLATE && t->env_parent_id == parent &&
+                sync_bool_compare_and_swap(&t->env_status, ENV_TEMPLATE, ENV_NOT_RUNNABLE))
+            env_free(t);
+}
+
+/*
+ * Frees env e and all memory it uses, and the templates it created.
+ */
+void env_free(struct env *envp)
+{
+    /* Static so that we can enter env_free from kernel threads
+     * from their own stack, without faulting because their stacks
+     * are being freed as this method goes on. */
+    static struct env *e;
+    static envid_t envid;
+    struct env *child;
+
+    e = envp;
+    envid = e->env_id;
+
+    /* Note the environment's demise. */
+    cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+
+    /* Never leave a freed env on a run or wait queue, nor its CPU reserved */
+    sched_remove(e);
+    wait_cancel(e);
+    if (e->env_rt.period) {
+        cprintf("[%08x] edf: %u periods, %u deadline misses\n",
+                e->env_id, e->env_rt.periods, e->env_rt.misses);
+        sched_set_realtime(e, 0, 0);
+    }
+
+    /* Shared memory handles die with their owner, mappings keep objects */
+    shm_destroy_owned(envid);
+
+    /* A vfork child leaves the address space to its parent. A vfork parent
+     * leaves it to its child, which still runs on it. */
+    if (env_vfork_release(e)) {
+        e->env_pgdir = 0;
+        e->vma_list = 0;
+    } else {
+        spin_lock(&vfork_lock);
+        if (e->vfork_child) {
+            child = &envs[ENVX(e->vfork_child)];
+            assert(child->env_id == e->vfork_child && child->vfork_parent == envid);
+            child->vfork_parent = 0;
+            e->vfork_child = 0;
+            e->env_pgdir = 0;
+            e->vma_list = 0;
+        }
+        spin_unlock(&vfork_lock);
+        if (e->env_pgdir)
+            env_free_vm(e);
+    }
 
     /* return the environment to the free list */
     e->env_status = ENV_FREE;
@@ -673,6 +810,12 @@ void env_free(struct env *envp)
 
     /* Zero out env */
     memset(e, 0, sizeof(env_t));
+
+    /* Only now, sys_wait checks for ENV_FREE under the same lock */
+    wake_up(env_exit_waitqueue(envid));
+
+    /* Last: freeing a template reuses the static e and envid */
+    env_free_templates(envid);
 }
 
 /*
@@ -682,24 +825,18 @@ void env_free(struct env *envp)
  */
 void env_destroy(struct env *e)
 {
-    size_t i;
     lock_env();
     assert_lock_env();
 
-    /* Mark all envs waiting for this env as runnable again */
-    for(i = 0; i < NENV; i++) {
-        env_t *env = &envs[i];
-        if(env && env->env_status == ENV_WAITING && env->waiting_for == e->env_id) {
-            env->env_status = ENV_RUNNABLE;
-            env->waiting_for = 0;
-        }
-    }
-
     /* If e is currently running on other CPUs, we change its state to
      * ENV_DYING. A zombie environment will be freed the next time
-     * it traps to the kernel. */
+     * it traps to the kernel. A queued env is taken off its run queue
+     * first, unless another CPU just picked it up. */
+    if (e->env_status == ENV_RUNNABLE)
+        sched_remove(e);
     if (e->env_status == ENV_RUNNING && curenv != e) {
         e->env_status = ENV_DYING;
+        unlock_env();
         return;
     }
 
@@ -765,6 +902,24 @@ void env_pop_tf(struct trapframe *tf)
     panic("env_pop_tf() should not return");
 }
 
+/**
+ * Charges the time since e->env_charged to the user or kernel time of e.
+ * Only the CPU running e calls this; a CPU that picks e up sets
+ * env_charged first, so time off the CPU is never charged.
+ * @param e env on this CPU
+ * @param user whether e ran in user mode since
+ */
+void env_charge(struct env *e, int user)
+{
+    uint64_t now = read_tsc();
+
+    if (user)
+        e->env_rusage.ru_utime += now - e->env_charged;
+    else
+        e->env_rusage.ru_stime += now - e->env_charged;
+    e->env_charged = now;
+}
+
 /*
  * Context switch from curenv to env e.
  * Note: if this is the first call to env_run, curenv is NULL.
@@ -818,6 +973,9 @@ void env_run(struct env *e)
     assert(curenv == e);
     assert(curenv->env_status == ENV_RUNNING);
 
+    /* Kernel time ends, user time starts */
+    env_charge(e, 0);
+
     /* restore env registers */
     env_pop_tf(&e->env_tf);
 }
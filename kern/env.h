@@ -15,13 +15,26 @@ void env_init_percpu(void);
 int  env_alloc(struct env **e, envid_t parent_id, enum env_type envtype);
 void env_free(struct env *e);
 void env_create(uint8_t *binary, enum env_type type);
+int  env_spawn(struct env **e, envid_t parent_id, const char *name);
+int  env_vfork(struct env **e, struct env *parent);
+int  env_exec(struct env *e, const char *name, struct page_info *stack, uintptr_t esp);
 void env_destroy(struct env *e); /* Does not return if e == curenv */
+void env_charge(struct env *e, int user);   /* CPU accounting */
+struct waitqueue *env_exit_waitqueue(envid_t envid); /* Woken when envid is freed */
 
 int  envid2env(envid_t envid, struct env **env_store, bool checkperm);
 /* The following two functions do not return */
 void env_run(struct env *e) __attribute__((noreturn));
 void env_pop_tf(struct trapframe *tf) __attribute__((noreturn));
 
+/* The embedded KERN_BINFILES images by name, generated by kern/Makefrag */
+struct binfile {
+    const char *name;       /* file name without directory, e.g. "hello" */
+    uint8_t *binary;
+};
+extern const struct binfile binfiles[];
+extern const int nbinfiles;
+
 /* Without this extra macro, we couldn't pass macros like TEST to ENV_CREATE
  * because of the C pre-processor's argument prescan rule. */
 #define ENV_PASTE3(x, y, z) x ## y ## z
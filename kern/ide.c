@@ -4,6 +4,7 @@
 
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/atomic_ops.h>
 #include <kern/ide.h>
 
 
@@ -34,8 +35,30 @@
 
 /* What disk to use. 0=master, 1=slave */
 static int diskno = 1;
-/* Number of sectors on our disk, initialized by ide_identify. */
-static uint32_t disk_sectors;
+/* Number of sectors on each disk, initialized by ide_identify. */
+static uint32_t disk_sectors[2];
+/* Held for a whole operation, both disks share the controller */
+static volatile uint32_t ide_busy = 0;
+
+void ide_lock(void)
+{
+    while (!ide_trylock())
+        asm volatile("pause");
+}
+
+int ide_trylock(void)
+{
+    if (!sync_bool_compare_and_swap(&ide_busy, 0, 1))
+        return 0;
+    sync_barrier();
+    return 1;
+}
+
+void ide_unlock(void)
+{
+    sync_barrier();
+    ide_busy = 0;
+}
 
 int ide_is_ready(void)
 {
@@ -87,9 +110,13 @@ static void ide_set_disk(int d)
 
 void ide_start_readwrite(uint32_t secno, size_t nsectors, int iswrite)
 {
-    int r;
+    ide_start_readwrite_disk(diskno, secno, nsectors, iswrite);
+}
 
+void ide_start_readwrite_disk(int d, uint32_t secno, size_t nsectors, int iswrite)
+{
     assert(nsectors <= 256);
+    assert(d == 0 || d == 1);
 
     ide_wait_ready(0);
 
@@ -97,7 +124,7 @@ void ide_start_readwrite(uint32_t secno, size_t nsectors, int iswrite)
     outb(IDE_REG_LBA_LO,   secno        & 0xFF);
     outb(IDE_REG_LBA_MID, (secno >>  8) & 0xFF);
     outb(IDE_REG_LBA_HI,  (secno >> 16) & 0xFF);
-    outb(IDE_REG_DRIVE,   0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+    outb(IDE_REG_DRIVE,   0xE0 | ((d&1)<<4) | ((secno>>24)&0x0F));
     outb(IDE_REG_COMMAND, iswrite ? IDE_COM_WRITE : IDE_COM_READ);
 }
 
@@ -117,7 +144,7 @@ void ide_write_sector(char *src)
  * Retrieve information about disk (such as number of sectors) using IDENTIFY
  * command.
  */
-static void ide_identify(void)
+static void ide_identify(int d)
 {
     uint16_t info[256];
 
@@ -127,21 +154,27 @@ static void ide_identify(void)
     outb(IDE_REG_LBA_LO,  0);
     outb(IDE_REG_LBA_MID, 0);
     outb(IDE_REG_LBA_HI,  0);
-    outb(IDE_REG_DRIVE,   0xA0 | ((diskno&1)<<4));
+    outb(IDE_REG_DRIVE,   0xA0 | ((d&1)<<4));
     outb(IDE_REG_COMMAND, IDE_COM_IDENTIFY);
 
     if (ide_wait_ready(1))
         panic("Error during IDENTIFY of IDE disk");
 
     ide_read_sector((char*)info);
-    disk_sectors = *((uint32_t*)&info[60]);
-    cprintf("[IDE] Found %u sectors on disk (=%dM)\n", disk_sectors,
-            disk_sectors / 2 / 1024);
+    disk_sectors[d] = *((uint32_t*)&info[60]);
+    cprintf("[IDE] Found %u sectors on disk %d (=%dM)\n", disk_sectors[d], d,
+            disk_sectors[d] / 2 / 1024);
 }
 
 uint32_t ide_num_sectors(void)
 {
-    return disk_sectors;
+    return disk_sectors[diskno];
+}
+
+uint32_t ide_disk_sectors(int d)
+{
+    assert(d == 0 || d == 1);
+    return disk_sectors[d];
 }
 
 int ide_init(void)
@@ -149,6 +182,7 @@ int ide_init(void)
     if (!ide_probe_disk1())
         panic("IDE: Could not find disk 1!");
     ide_set_disk(1);
-    ide_identify();
+    ide_identify(IDE_DISK_SWAP);
+    ide_identify(IDE_DISK_BOOT);
     return 0;
 }
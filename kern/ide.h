@@ -5,6 +5,10 @@
 
 #define SECTSIZE 512
 
+/* Disk numbers: the boot disk holds the kernel image, the other one swap */
+#define IDE_DISK_BOOT 0
+#define IDE_DISK_SWAP 1
+
 /*
  * Initialized the IDE driver. For JOS, we will only use this driver for
  * swapping, which is done on a separate disk: the slave of the pimary
@@ -15,6 +19,16 @@
  */
 int ide_init(void);
 uint32_t ide_num_sectors(void);
+/* Number of sectors on disk d (IDE_DISK_*) */
+uint32_t ide_disk_sectors(int d);
+
+/*
+ * Both disks share one controller. Hold the lock for a whole operation (start
+ * up to the last sector) and never yield while holding it.
+ */
+void ide_lock(void);
+int ide_trylock(void);
+void ide_unlock(void);
 
 /*
  * Polls the disk and returns whether it is ready to do a read/write of a
@@ -31,6 +45,8 @@ int ide_is_ready(void);
  * the driver itself is not concurrency-safe.
  */
 void ide_start_readwrite(uint32_t secno, size_t nsectors, int iswrite);
+/* Same as ide_start_readwrite, on disk d instead of the swap disk */
+void ide_start_readwrite_disk(int d, uint32_t secno, size_t nsectors, int iswrite);
 static inline void ide_start_read(uint32_t secno, size_t nsectors)
 {
     ide_start_readwrite(secno, nsectors, 0);
@@ -15,6 +15,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/ide.h>
+#include <kern/shm.h>
 
 static void boot_aps(void);
 
@@ -42,6 +43,9 @@ void i386_init(void)
     /* Assertions */
     assert(sizeof(struct vma_arr)<= PGSIZE);
 
+    /* Shared zero page for anonymous memory */
+    vma_zero_page_init();
+
     /* Lab 3 user environment initialization functions. */
     env_init();
     trap_init();
@@ -54,6 +58,9 @@ void i386_init(void)
     pic_init();
 
     ide_init();
+
+    /* Disk data area for disk backed mappings */
+    shm_disk_init();
     
     /* Initialize swappy (global space) */
     swappy_init();
@@ -1,10 +1,12 @@
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/* Support for reading the NVRAM from the real-time clock, and for timing
+ * with the PIT. */
 
 #include <inc/x86.h>
 
 #include <kern/kclock.h>
+#include <kern/cpu.h>
 
 
 unsigned mc146818_read(unsigned reg)
@@ -18,3 +20,39 @@ void mc146818_write(unsigned reg, unsigned datum)
     outb(IO_RTC, reg);
     outb(IO_RTC+1, datum);
 }
+
+/*
+ * Busy-waits 'us' microseconds (at most 54925) on channel 2 of the PIT.
+ * The PIT runs at a known rate on every PC, which makes it the reference
+ * to calibrate the TSC and LAPIC timer against. Not reentrant, the PIT is
+ * shared by all CPUs.
+ */
+void pit_wait(unsigned us)
+{
+    uint32_t count = (uint64_t) PIT_HZ * us / 1000000;
+
+    /* Gate channel 2 on, keep the speaker off */
+    outb(IO_PORTB, (inb(IO_PORTB) & ~0x02) | 0x01);
+    /* Channel 2, lobyte/hibyte, mode 0: output goes high at terminal count */
+    outb(IO_PIT_CTRL, 0xB0);
+    outb(IO_PIT + 2, count & 0xff);
+    outb(IO_PIT + 2, count >> 8);
+    while (!(inb(IO_PORTB) & 0x20))
+        ;
+}
+
+/* Converts microseconds to TSC cycles of this CPU */
+uint64_t usec_to_tsc(uint64_t us)
+{
+    uint32_t khz = thiscpu->cpu_tsc_khz ? thiscpu->cpu_tsc_khz : TSC_KHZ_DEFAULT;
+
+    return us * khz / 1000;
+}
+
+/* Converts TSC cycles of this CPU to microseconds */
+uint64_t tsc_to_usec(uint64_t cycles)
+{
+    uint32_t khz = thiscpu->cpu_tsc_khz ? thiscpu->cpu_tsc_khz : TSC_KHZ_DEFAULT;
+
+    return cycles * 1000 / khz;
+}
@@ -6,8 +6,17 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define IO_RTC          0x070       /* RTC port */
 
+#define IO_PIT          0x040       /* 8253/8254 PIT ports */
+#define IO_PIT_CTRL     (IO_PIT + 3)
+#define IO_PORTB        0x061       /* PIT channel 2 gate and output */
+#define PIT_HZ          1193182
+
+#define TSC_KHZ_DEFAULT 1000000     /* Assumed without calibration: 1 GHz */
+
 #define MC_NVRAM_START  0xe /* start of NVRAM: offset 14 */
 #define MC_NVRAM_SIZE   50  /* 50 bytes of NVRAM */
 
@@ -29,4 +38,8 @@
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 
+void pit_wait(unsigned us);
+uint64_t usec_to_tsc(uint64_t us);
+uint64_t tsc_to_usec(uint64_t cycles);
+
 #endif /* !JOS_KERN_KCLOCK_H */
@@ -15,6 +15,7 @@
 #include "pmap.h"
 #include "inc/atomic_ops.h"
 #include "vma.h"
+#include "sched.h"
 #include "inc/x86.h"
 
 uint32_t kern_get_percpu_stack_pointer() {
@@ -40,8 +41,9 @@ int kern_thread_create(void* entry) {
     e->env_tf.tf_esp = (uint32_t)KERNEL_THREAD_STACK_TOP;
     e->env_tf.tf_regs.reg_edx = (uint32_t)entry;
     
-    /* Map some stack region */
-    vma_new(e, (void*)KERNEL_THREAD_STACK_TOP-0x08000000, 0x08000000, VMA_PERM_WRITE | VMA_PERM_READ, VMA_ANON);
+    /* Map some stack region, it grows up to 128MB on use */
+    e->stack_limit = 0x08000000;
+    vma_new_stack(e, (void*)KERNEL_THREAD_STACK_TOP, PGSIZE, VMA_PERM_WRITE | VMA_PERM_READ);
     
     /* page alloc stack */
     page_info_t *pp = page_alloc(ALLOC_ZERO);
@@ -52,8 +54,8 @@ int kern_thread_create(void* entry) {
     page_insert(e->env_pgdir, pp,(void*) KERNEL_THREAD_STACK_TOP-PGSIZE, PTE_BIT_RW);
     
     /* Now its runnable, mark it as such */
-    if (sync_bool_compare_and_swap(&e->env_status, ENV_NOT_RUNNABLE, ENV_RUNNABLE) == 0)
-        panic("Set runnable failed!");
+    assert(e->env_status == ENV_NOT_RUNNABLE);
+    sched_wakeup(e);
 
     return 0;
 }
@@ -9,6 +9,7 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/kclock.h>
 
 /* Local APIC registers, divided by 4 for use as uint32_t[] indices. */
 #define ID          (0x0020/4)   /* ID */
@@ -33,6 +34,7 @@
 #define TIMER       (0x0320/4)   /* Local Vector Table 0 (TIMER) */
     #define X1         0x0000000B   /* divide counts by 1 */
     #define PERIODIC   0x00020000   /* Periodic */
+    #define TSCDEADLINE 0x00040000  /* Fire when the TSC reaches IA32_TSC_DEADLINE */
 #define PCINT       (0x0340/4)   /* Performance Counter LVT */
 #define LINT0       (0x0350/4)   /* Local Vector Table 1 (LINT0) */
 #define LINT1       (0x0360/4)   /* Local Vector Table 2 (LINT1) */
@@ -42,9 +44,17 @@
 #define TCCR        (0x0390/4)   /* Timer Current Count */
 #define TDCR        (0x03E0/4)   /* Timer Divide Configuration */
 
+#define LAPIC_CAL_US    10000       /* Calibration time against the PIT */
+
+#define MSR_IA32_TSC_DEADLINE   0x6E0
+#define CPUID_1_ECX_TSC_DEADLINE (1 << 24)
+
 physaddr_t lapicaddr;        /* Initialized in mpconfig.c */
 volatile uint32_t *lapic;
 
+/* Whether the timer is armed with a TSC deadline instead of a count */
+static int lapic_tsc_deadline;
+
 static void lapicw(int index, int value)
 {
     lapic[index] = value;
@@ -53,6 +63,9 @@ static void lapicw(int index, int value)
 
 void lapic_init(void)
 {
+    uint64_t start;
+    uint32_t ecx;
+
     if (!lapicaddr)
         return;
 
@@ -63,13 +76,33 @@ void lapic_init(void)
     /* Enable local APIC; set spurious interrupt vector. */
     lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-    /* The timer repeatedly counts down at bus frequency from lapic[TICR] and
-     * then issues an interrupt.
-     * If we cared more about precise timekeeping, TICR would be calibrated
-     * using an external time source. */
+    /* Measure the TSC and the (masked) timer against the PIT, the one clock
+     * with a known rate. Neither rate is the same on every host, QEMU
+     * especially, and CPUs may differ too. */
     lapicw(TDCR, X1);
-    lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-    lapicw(TICR, 10000000);
+    lapicw(TIMER, MASKED);
+    lapicw(TICR, 0xffffffff);
+    start = read_tsc();
+    pit_wait(LAPIC_CAL_US);
+    thiscpu->cpu_lapic_khz = (0xffffffff - lapic[TCCR]) / (LAPIC_CAL_US / 1000);
+    thiscpu->cpu_tsc_khz = (read_tsc() - start) / (LAPIC_CAL_US / 1000);
+    if (!thiscpu->cpu_lapic_khz || !thiscpu->cpu_tsc_khz) {
+        cprintf("CPU %d: clock calibration failed, assuming 1 GHz\n", cpunum());
+        thiscpu->cpu_lapic_khz = thiscpu->cpu_tsc_khz = TSC_KHZ_DEFAULT;
+    }
+    if (thiscpu == bootcpu)
+        cprintf("TSC %u kHz, LAPIC timer %u kHz\n",
+                thiscpu->cpu_tsc_khz, thiscpu->cpu_lapic_khz);
+
+    /* The timer is one-shot: the scheduler arms it for the end of the
+     * running env's slice or the next deadline it knows of, and leaves it
+     * off while idle with nothing pending (lapic_timer_arm). Use the TSC
+     * deadline mode when the CPU has it, which saves the conversion to
+     * timer ticks. */
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    lapic_tsc_deadline = !!(ecx & CPUID_1_ECX_TSC_DEADLINE);
+    lapicw(TICR, 0);
+    lapicw(TIMER, (lapic_tsc_deadline ? TSCDEADLINE : 0) | (IRQ_OFFSET + IRQ_TIMER));
 
     /* Leave LINT0 of the BSP enabled so that it can get interrupts from the
      * 8259A chip.
@@ -125,6 +158,45 @@ void lapic_eoi(void)
         lapicw(EOI, 0);
 }
 
+/*
+ * Makes this CPU's timer fire once, 'cycles' TSC cycles from now.
+ * Rearming replaces the previous expiry.
+ */
+void lapic_timer_arm(uint64_t cycles)
+{
+    uint64_t ticks;
+
+    if (!lapic)
+        return;
+
+    if (!cycles)
+        cycles = 1;
+
+    if (lapic_tsc_deadline) {
+        wrmsr(MSR_IA32_TSC_DEADLINE, read_tsc() + cycles);
+        return;
+    }
+
+    if (cycles > (1ULL << 40))
+        cycles = 1ULL << 40;    /* Beyond the 32 bit count anyway, keep the product in range */
+    ticks = cycles * thiscpu->cpu_lapic_khz / thiscpu->cpu_tsc_khz;
+    lapicw(TICR, MIN(MAX(ticks, 1), 0xffffffff));
+}
+
+/*
+ * Stops this CPU's timer, no interrupt until it is armed again.
+ */
+void lapic_timer_disarm(void)
+{
+    if (!lapic)
+        return;
+
+    if (lapic_tsc_deadline)
+        wrmsr(MSR_IA32_TSC_DEADLINE, 0);
+    else
+        lapicw(TICR, 0);
+}
+
 /*
  * Spin for a given number of microseconds.
  * On real hardware would want to tune this dynamically.
@@ -133,8 +205,6 @@ static void microdelay(int us)
 {
 }
 
-#define IO_RTC  0x70
-
 /*
  * Start additional processor running entry code at addr.
  * See Appendix B of MultiProcessor Specification.
@@ -181,3 +251,16 @@ void lapic_ipi(int vector)
     while (lapic[ICRLO] & DELIVS)
         ;
 }
+
+/**
+ * Sends a fixed interrupt to a single CPU
+ * @param apicid local APIC ID of the target
+ * @param vector interrupt vector
+ */
+void lapic_ipi_cpu(int apicid, int vector)
+{
+    lapicw(ICRHI, apicid << 24);
+    lapicw(ICRLO, FIXED | ASSERT | vector);
+    while (lapic[ICRLO] & DELIVS)
+        ;
+}
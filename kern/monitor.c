@@ -14,6 +14,9 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/env.h>
+#include <kern/vma.h>
+#include <kern/pagecache.h>
+#include <kern/kclock.h>
 
 #define CMDBUF_SIZE 80  /* enough for one VGA text line */
 
@@ -29,6 +32,9 @@ static struct command commands[] = {
     { "help", "Display this list of commands", mon_help },
     { "kerninfo", "Display information about the kernel", mon_kerninfo },
     { "backtrace", "Display stack backtrace", mon_backtrace },
+    { "memstat", "Display shared page statistics", mon_memstat },
+    { "pfstat", "Display page fault statistics", mon_pfstat },
+    { "rusage", "Display CPU usage of envs, or page faults of one [envid]", mon_rusage },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -58,6 +64,59 @@ int mon_kerninfo(int argc, char **argv, struct trapframe *tf)
     return 0;
 }
 
+int mon_memstat(int argc, char **argv, struct trapframe *tf)
+{
+    cprintf("Zero page: %u pte's\n", vma_zero_page_refs());
+    cprintf("Page cache: %u pages\n", pagecache_count());
+    return 0;
+}
+
+int mon_pfstat(int argc, char **argv, struct trapframe *tf)
+{
+    pagefault_stats_dump();
+    return 0;
+}
+
+int mon_rusage(int argc, char **argv, struct trapframe *tf)
+{
+    struct rusage *ru;
+    struct env *e;
+    envid_t envid;
+    uint32_t faults;
+    int i, t;
+
+    if (argc > 1) {
+        envid = strtol(argv[1], NULL, 16);
+        e = &envs[ENVX(envid)];
+        if (e->env_id != envid || e->env_status == ENV_FREE) {
+            cprintf("No env %08x\n", envid);
+            return 0;
+        }
+        ru = &e->env_rusage;
+        cprintf("%-20s %10s\n", "type", "faults");
+        for (t = 0; t < PAGEFAULT_TYPE_COUNT; t++)
+            if (ru->ru_faults[t])
+                cprintf("%-20s %10u\n", pagefault_name(t), ru->ru_faults[t]);
+        return 0;
+    }
+
+    cprintf("%-8s %10s %10s %10s %7s %7s %7s\n", "env", "user us",
+            "sys us", "swap us", "vcsw", "ivcsw", "faults");
+    for (i = 0; i < NENV; i++) {
+        if (envs[i].env_status == ENV_FREE)
+            continue;
+        ru = &envs[i].env_rusage;
+        for (t = 0, faults = 0; t < PAGEFAULT_TYPE_COUNT; t++)
+            faults += ru->ru_faults[t];
+        cprintf("%08x %10u %10u %10u %7u %7u %7u\n", envs[i].env_id,
+                (uint32_t) tsc_to_usec(ru->ru_utime),
+                (uint32_t) tsc_to_usec(ru->ru_stime),
+                (uint32_t) tsc_to_usec(ru->ru_swaptime),
+                ru->ru_nvcsw, ru->ru_nivcsw, faults);
+    }
+    return 0;
+}
+
 int mon_backtrace(int argc, char **argv, struct trapframe *tf)
 {
     int i;
@@ -17,5 +17,8 @@ void monitor(struct trapframe *tf);
 int mon_help(int argc, char **argv, struct trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct trapframe *tf);
+int mon_memstat(int argc, char **argv, struct trapframe *tf);
+int mon_pfstat(int argc, char **argv, struct trapframe *tf);
+int mon_rusage(int argc, char **argv, struct trapframe *tf);
 
 #endif /* !JOS_KERN_MONITOR_H */
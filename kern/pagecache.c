@@ -0,0 +1,156 @@
+/* 
+ * File:   pagecache.c
+ *
+ * Page cache for pages filled from embedded binaries.
+ */
+
+#include "pagecache.h"
+#include "spinlock.h"
+#include "inc/assert.h"
+
+typedef struct {
+    uint32_t src;
+    uint32_t end;
+    page_info_t * pp;
+} pagecache_entry;
+
+/* Open addressing hash table, src 0 marks a free slot */
+static pagecache_entry pagecache[PAGECACHE_SIZE];
+static uint32_t pagecache_used = 0;
+static struct spinlock pagecache_lock = { .locked = 0 };
+
+static inline uint32_t pagecache_hash(uint32_t src) {
+    return (src >> 12) % PAGECACHE_SIZE;
+}
+
+/* Whether slot i lies cyclically in (from, to] */
+static inline int pagecache_between(uint32_t i, uint32_t from, uint32_t to) {
+    return from < to ? (i > from && i <= to) : (i > from || i <= to);
+}
+
+/**
+ * Frees slot i, moving later entries of its probe run back into the hole
+ *  so lookups keep finding them. Lock must be held.
+ */
+static void pagecache_remove(uint32_t i) {
+    uint32_t j = i;
+
+    for (;;) {
+        j = (j + 1) % PAGECACHE_SIZE;
+        if (!pagecache[j].src)
+            break;
+        /* An entry may fill the hole unless its home slot lies after it */
+        if (!pagecache_between(pagecache_hash(pagecache[j].src), i, j)) {
+            pagecache[i] = pagecache[j];
+            i = j;
+        }
+    }
+    pagecache[i].src = 0;
+    pagecache[i].pp = 0;
+    pagecache_used--;
+}
+
+/**
+ * Drops all pages only the cache holds. Lock must be held.
+ * @return number of pages freed
+ */
+static uint32_t pagecache_shrink_locked(void) {
+    uint32_t i, n = 0;
+
+    for (i = 0; i < PAGECACHE_SIZE; i++) {
+        /* A removal may move another entry into slot i, look again */
+        while (pagecache[i].src && page_get_ref(pagecache[i].pp) == 1) {
+            page_decref(pagecache[i].pp);
+            pagecache_remove(i);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Finds the slot for src/end, or the free slot where it belongs
+ *  Lock must be held.
+ * @return slot pointer, 0 if the table is full and src is not in it
+ */
+static pagecache_entry * pagecache_find(uint32_t src, uint32_t end) {
+    uint32_t h = pagecache_hash(src);
+
+    for (uint32_t i = 0; i < PAGECACHE_SIZE; i++) {
+        pagecache_entry *ent = &pagecache[(h + i) % PAGECACHE_SIZE];
+        if (!ent->src || (ent->src == src && ent->end == end))
+            return ent;
+    }
+
+    return 0;
+}
+
+page_info_t * pagecache_lookup(uint32_t src, uint32_t end) {
+    page_info_t *pp = 0;
+
+    spin_lock(&pagecache_lock);
+    pagecache_entry *ent = pagecache_find(src, end);
+    if (ent && ent->src) {
+        /* Under the lock, so pagecache_shrink cannot free it meanwhile */
+        pp = ent->pp;
+        page_inc_ref(pp);
+    }
+    spin_unlock(&pagecache_lock);
+
+    return pp;
+}
+
+page_info_t * pagecache_insert(uint32_t src, uint32_t end, page_info_t *pp) {
+    assert(src);
+
+    spin_lock(&pagecache_lock);
+    pagecache_entry *ent = pagecache_find(src, end);
+
+    /* Full (keep one slot free so lookups terminate fast): make room by
+     * dropping pages nobody maps anymore */
+    if (!ent || (!ent->src && pagecache_used >= PAGECACHE_SIZE - 1)) {
+        if (pagecache_shrink_locked())
+            ent = pagecache_find(src, end);
+        if (!ent || (!ent->src && pagecache_used >= PAGECACHE_SIZE - 1)) {
+            spin_unlock(&pagecache_lock);
+            return 0;
+        }
+    }
+
+    /* Someone beat us to it */
+    if (ent->src) {
+        pp = ent->pp;
+        page_inc_ref(pp);
+        spin_unlock(&pagecache_lock);
+        return pp;
+    }
+
+    /* One reference for the cache, one for the caller */
+    page_inc_ref(pp);
+    page_inc_ref(pp);
+    ent->src = src;
+    ent->end = end;
+    ent->pp = pp;
+    pagecache_used++;
+    spin_unlock(&pagecache_lock);
+
+    dprintf("pagecache: cached %p for %p (%d pages)\n", pp, src, pagecache_used);
+    return pp;
+}
+
+uint32_t pagecache_shrink() {
+    uint32_t n;
+
+    spin_lock(&pagecache_lock);
+    n = pagecache_shrink_locked();
+    spin_unlock(&pagecache_lock);
+
+    if (n)
+        dprintf("pagecache: dropped %u pages\n", n);
+    return n;
+}
+
+uint32_t pagecache_count() {
+    return pagecache_used;
+}
@@ -0,0 +1,55 @@
+/* 
+ * File:   pagecache.h
+ *
+ * Page cache for pages filled from embedded binaries. Pages with the same
+ * backing content are shared (refcounted) between all envs mapping them.
+ */
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+#include "inc/memlayout.h"
+#include "pmap.h"
+
+/* Maximum number of cached pages */
+#define PAGECACHE_SIZE 1024
+
+/*
+ * A cached page is identified by the kernel address its first byte is
+ * copied from (this may lie before the backing for an unalligned first page)
+ * and the end of the backing (content past it is zero).
+ *
+ * The cache holds one reference per page. Pages only the cache holds are
+ * dropped when the table is full or memory runs low (pagecache_shrink).
+ */
+
+/**
+ * Looks up a cached page
+ * @param src kernel address the page content starts at
+ * @param end kernel address where the backing ends
+ * @return the cached page with a reference for the caller, 0 if not cached
+ */
+page_info_t * pagecache_lookup(uint32_t src, uint32_t end);
+
+/**
+ * Adds a filled page to the cache, the cache takes its own reference
+ *  If another cpu cached the same content first, that page is returned instead.
+ * @param src kernel address the page content starts at
+ * @param end kernel address where the backing ends
+ * @param pp the filled page
+ * @return the cached page with a reference for the caller, 0 if the cache
+ *  is full
+ */
+page_info_t * pagecache_insert(uint32_t src, uint32_t end, page_info_t *pp);
+
+/**
+ * Drops the pages no env maps anymore
+ * @return number of pages freed
+ */
+uint32_t pagecache_shrink();
+
+/**
+ * Returns the number of cached pages
+ */
+uint32_t pagecache_count();
+
+#endif /* PAGECACHE_H */
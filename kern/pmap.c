@@ -16,6 +16,8 @@
 #include "inc/atomic_ops.h"
 #include "spinlock.h"
 #include "sched.h"
+#include "vma.h"
+#include "swappy.h"
 #include "../inc/env.h"
 
 /* These variables are set by i386_detect_memory() */
@@ -908,12 +910,21 @@ pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create) {
     if (entry & PDE_BIT_HUGE) //if its 4M, this is your entry
             return &pgdir[pgdi];
 
+    //A table shared by fork is copied before anyone changes its entries,
+    //lookups read the shared one
+    if (pgdi < PDX(UTOP) && PDE_IS_SHARED(entry) &&
+            (create & (CREATE_NORMAL | CREATE_HUGE | WALK_WRITE))) {
+        if (pgtable_unshare(pgdir, pgdi))
+            return NULL;
+        entry = pgdir[pgdi];
+    }
+
     //determine table exist (and create if applicable)
     if (!entry) {
         //Does not exist
 
         //Are we told to create a page? No? NULL you go
-        if (create == 0)
+        if (!(create & (CREATE_NORMAL | CREATE_HUGE)))
             return NULL;
 
         //Create a 4K page
@@ -971,6 +982,75 @@ pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create) {
     return &pgtable[ptdi];
 }
 
+/* Serializes the reference check and drop on tables shared by fork, so
+ * that exactly one sharer ends up with the original table */
+static struct spinlock pgtable_share_lock = { .locked = 0 };
+
+/**
+ * Gives pgdir a private copy of the shared page table at pgdir[pdx]
+ *  The copy takes a reference to every present page and both tables lose
+ *  RW on them, from here on the pages are COW'd one by one like after a
+ *  regular fork. Swapped entries take another swap slot reference.
+ *  The last sharer just write enables the table again.
+ * @param pgdir
+ * @param pdx
+ * @return 0 on success, -1 if no page table could be allocated
+ */
+int pgtable_unshare(pde_t *pgdir, uint32_t pdx) {
+    page_info_t *old = pa2page(PDE_GET_ADDRESS(pgdir[pdx]));
+    page_info_t *copy;
+    pte_t *src, *dst;
+
+    spin_lock(&pgtable_share_lock);
+    if (page_get_ref(old) > 1) {
+        if (!(copy = page_alloc(0))) {
+            spin_unlock(&pgtable_share_lock);
+            return -1;
+        }
+
+        src = page2kva(old);
+        dst = page2kva(copy);
+        for (uint32_t i = 0; i < NPTENTRIES; i++) {
+            if (src[i] & PTE_BIT_PRESENT) {
+                src[i] &= ~(uint32_t)PTE_BIT_RW;
+                if (PGNUM(PTE_GET_PHYS_ADDRESS(src[i])) < npages)
+                    page_inc_ref(pa2page(PTE_GET_PHYS_ADDRESS(src[i])));
+            } else if (PTE_GET_PHYS_ADDRESS(src[i]))
+                swappy_dup_swapped(src[i]);
+            dst[i] = src[i];
+        }
+
+        page_inc_ref(copy);
+        pgdir[pdx] = page2pa(copy) | (pgdir[pdx] & 0xFFF);
+        page_decref(old);
+    }
+
+    pgdir[pdx] |= PDE_BIT_RW;
+    spin_unlock(&pgtable_share_lock);
+
+    /* The whole 4MB region changed */
+    if (!curenv || curenv->env_pgdir == pgdir)
+        tlbflush();
+
+    return 0;
+}
+
+void pgtable_release_shared(pde_t *pgdir) {
+    spin_lock(&pgtable_share_lock);
+    for (uint32_t pdx = 0; pdx < PDX(UTOP); pdx++) {
+        if (!PDE_IS_SHARED(pgdir[pdx]))
+            continue;
+
+        page_info_t *table = pa2page(PDE_GET_ADDRESS(pgdir[pdx]));
+        if (page_get_ref(table) > 1) {
+            pgdir[pdx] = 0;
+            page_decref(table);
+        } else
+            pgdir[pdx] |= PDE_BIT_RW;
+    }
+    spin_unlock(&pgtable_share_lock);
+}
+
 /*
  * Map [va, va+size) of virtual address space to physical [pa, pa+size)
  * in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
@@ -1129,6 +1209,8 @@ struct page_info *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store) {
 /*
  * Unmaps the physical page at virtual address 'va'.
  * If there is no physical page at that address, silently does nothing.
+ * Returns -E_NO_MEM if the page table is shared by fork and could not be
+ * copied (the page stays mapped), 0 otherwise.
  *
  * Details:
  *   - The ref count on the physical page should decrement.
@@ -1141,14 +1223,19 @@ struct page_info *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store) {
  * Hint: The TA solution is implemented using page_lookup,
  *  tlb_invalidate, and page_decref.
  */
-void page_remove(pde_t *pgdir, void *va) {
-    //Get page and entry info
+int page_remove(pde_t *pgdir, void *va) {
+    //Get page and entry info, the entry is ours to change
     pte_t * pentry = 0;
-    struct page_info * page = page_lookup(pgdir, va, &pentry);
+    struct page_info * page = 0;
+
+    if (pgdir_walk(pgdir, va, WALK_WRITE))
+        page = page_lookup(pgdir, va, &pentry);
+    else if (PDX(va) < PDX(UTOP) && PDE_IS_SHARED(pgdir[PDX(va)]))
+        return -E_NO_MEM;
 
     //Be silent
     if (!page)
-        return;
+        return 0;
 
     /** Start page removal **/
 
@@ -1163,6 +1250,8 @@ void page_remove(pde_t *pgdir, void *va) {
 
     //invalidate entry
     tlb_invalidate(pgdir, va);
+
+    return 0;
 }
 
 /*
@@ -1263,13 +1352,23 @@ int user_mem_check(struct env *env, const void *va, size_t len, int perm)
     user_mem_check_addr = addr;
     addr = ROUNDDOWN(addr, PGSIZE);
 
-    //Check all pages
-    for(uint32_t i = addr; i <= addr+len;) {
+    //Check all pages (at least the one va lies in)
+    uint32_t end = (uint32_t) va + len;
+    for(uint32_t i = addr; i < end || i == addr;) {
         /* Get pte entry pointer */
         pte_t * pentry = pgdir_walk(env->env_pgdir, (void*) i, 0);
 
+        /* Demand paged memory: fill it now if a vma allows the access */
+        if ((!pentry || !*pentry) && i < ULIM) {
+            vma_t * vma = vma_lookup(env, (void*) i, 0);
+            int vma_perm = perm & PTE_BIT_RW ? VMA_PERM_WRITE : ~0;
+            if (vma && (vma->perm & vma_perm) &&
+                    !vma_populate_page(env, vma, i, perm & PTE_BIT_RW))
+                pentry = pgdir_walk(env->env_pgdir, (void*) i, 0);
+        }
+
         /* check pte permissions */
-        hasperm &= perm == ((*pentry) & perm);
+        hasperm &= pentry && perm == ((*pentry) & perm);
 
         /* Check address */
         validaddr &= i < ULIM;
@@ -78,6 +78,8 @@ extern pde_t *kern_pgdir;
 #define PTE_BIT_DISABLECACHE    (1 << 4)
 /* Set by cpu. if set, page is accessed. OS must clear if OS needs this. */
 #define PTE_BIT_ACCESSED        (1 << 5)
+/* Set by cpu on a write to the page. OS must clear if OS needs this. */
+#define PTE_BIT_DIRTY           (1 << 6)
 /** (Is set by cpu?) Must be unset by OS?
  * "If the Dirty flag ('D') is set, then the page has been written to.
  * This flag is not updated by the CPU, and once set will not unset itself." ~ OSDEV.wiki */
@@ -103,6 +105,13 @@ extern pde_t *kern_pgdir;
  */
 #define PTE_GET_PHYS_ADDRESS(A) (A & 0xFFFFF000)
 
+/*
+ * True for a page table that fork shares between address spaces: present,
+ * not huge and write protected at the directory level.
+ * Only meaningful below UTOP.
+ */
+#define PDE_IS_SHARED(A) (((A) & (PDE_BIT_PRESENT | PDE_BIT_RW | PDE_BIT_HUGE)) == PDE_BIT_PRESENT)
+
 #define VA_GET_PDE_INDEX(A) (((uint32_t) (A) >> 22) & 0x3FF) //10bit mask
 #define VA_GET_PTE_INDEX(A) (((uint32_t) (A) >> 12) & 0x3FF)
 
@@ -144,6 +153,9 @@ enum {
     /* For pgdir_walk, tells whether to create normal page or huge page */
     CREATE_NORMAL = 1<<0,
     CREATE_HUGE   = 1<<1,
+    /* The caller changes the entry: a table shared by fork is copied first.
+     * Implied by the create flags, other walks may return a shared table. */
+    WALK_WRITE    = 1<<2,
 };
 
 void mem_init(void);
@@ -152,7 +164,7 @@ void page_init(void);
 struct page_info *page_alloc(int alloc_flags);
 void page_free(struct page_info *pp);
 int page_insert(pde_t *pgdir, struct page_info *pp, void *va, int perm);
-void page_remove(pde_t *pgdir, void *va);
+int page_remove(pde_t *pgdir, void *va);
 struct page_info *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void page_decref(struct page_info *pp);
 
@@ -197,6 +209,24 @@ static inline void *page2kva(struct page_info *pp)
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
+/**
+ * Gives pgdir a private copy of the shared page table at pgdir[pdx]
+ *  The table page's reference count counts the address spaces sharing it.
+ *  pgdir_walk calls this for walks that change the table (create flags or
+ *  WALK_WRITE), lookups leave the table shared.
+ * @param pgdir
+ * @param pdx index of a PDE_IS_SHARED entry
+ * @return 0 on success, -1 if no page table could be allocated
+ */
+int pgtable_unshare(pde_t *pgdir, uint32_t pdx);
+
+/**
+ * Drops the references of pgdir to the page tables it shares
+ *  The tables are unmapped, the last sharer of a table gets it back instead.
+ * @param pgdir
+ */
+void pgtable_release_shared(pde_t *pgdir);
+
 struct page_info* alloc_consecutive_pages(uint16_t amount, int alloc_flags);
 
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
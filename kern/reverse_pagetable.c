@@ -17,19 +17,10 @@
 volatile int reverse_pagetable_look_kern = 0;
 
 /**
- * Looksup a given physical page [page] entry in given pagetable [pd]
- *  To enable repeated coninued iterations and returns (yield in python)
- *  Two pointers to iterators must be given: [pgdir_i] and [pte_i]
- *  Initialize [pgdir_i] and [pte_i] to zero everytime this function returns 0
- *  and on the first call
- *  This function can be called repeatedly untill it returns 0 for incremental results
- * @param pd page directory to search
- * @param page physical discriptor of the page to find
- * @param pgdir_i iterator for the page directory
- * @param pte_i iterator for the page table
- * @return pte_t pointer if found, 0 if nothing was found
+ * Looks up a pte in [pd] which holds [addr] as address and whose present
+ *  bit equals [present], see reverse_pte_lookup_pgdir for the iterators
  */
-pte_t * reverse_pte_lookup_pgdir(pde_t * pd, page_info_t* page, uint16_t* pgdir_i, uint16_t* pte_i){
+static pte_t * __reverse_lookup_pgdir(pde_t * pd, uint32_t addr, int present, uint16_t* pgdir_i, uint16_t* pte_i){
     
     for(; *pgdir_i < (UTOP/(PGSIZE*1024)); (*pgdir_i)++) {
         /* entry must be present */
@@ -47,8 +38,8 @@ pte_t * reverse_pte_lookup_pgdir(pde_t * pd, page_info_t* page, uint16_t* pgdir_
         /* Enter pgtable */
         pte_t * pt = (pte_t * )KADDR(PDE_GET_ADDRESS(pd[*pgdir_i]));
         for(; *pte_i < 1024; (*pte_i)++) {
-            uint32_t pa = PTE_GET_PHYS_ADDRESS(pt[*pte_i]);
-            if (pa && pa2page(pa) == page) {
+            if (PTE_GET_PHYS_ADDRESS(pt[*pte_i]) == addr &&
+                    (pt[*pte_i] & PTE_BIT_PRESENT) == present) {
                 //Our page, return pte
                 return &pt[*pte_i];
             }
@@ -59,13 +50,27 @@ pte_t * reverse_pte_lookup_pgdir(pde_t * pd, page_info_t* page, uint16_t* pgdir_
 }
 
 /**
- * Find a pte that references the physical page described by [page]
+ * Looksup a given physical page [page] entry in given pagetable [pd]
+ *  To enable repeated coninued iterations and returns (yield in python)
+ *  Two pointers to iterators must be given: [pgdir_i] and [pte_i]
+ *  Initialize [pgdir_i] and [pte_i] to zero everytime this function returns 0
+ *  and on the first call
  *  This function can be called repeatedly untill it returns 0 for incremental results
- * @param page the physical page, described by [page], to find
- * @param iter The non-volatile iterator
+ * @param pd page directory to search
+ * @param page physical discriptor of the page to find
+ * @param pgdir_i iterator for the page directory
+ * @param pte_i iterator for the page table
  * @return pte_t pointer if found, 0 if nothing was found
  */
-pte_t * reverse_pte_lookup(page_info_t * page, uint64_t * iter) {
+pte_t * reverse_pte_lookup_pgdir(pde_t * pd, page_info_t* page, uint16_t* pgdir_i, uint16_t* pte_i){
+    return __reverse_lookup_pgdir(pd, page2pa(page), PTE_BIT_PRESENT, pgdir_i, pte_i);
+}
+
+/**
+ * Finds a pte in any env which holds [addr] as address and whose present
+ *  bit equals [present], see reverse_pte_lookup for the iterator
+ */
+static pte_t * __reverse_lookup(uint32_t addr, int present, uint64_t * iter) {
     if (iter == 0) {
         eprintf("Invalid usage of this function: iter must be a valid pointer!\n");
         return 0;
@@ -104,7 +109,7 @@ pte_t * reverse_pte_lookup(page_info_t * page, uint64_t * iter) {
         }
         
         /* Iterate its pgdir */
-        pte_t * res = reverse_pte_lookup_pgdir(envs[*env_i].env_pgdir,page, pgdir_i, pte_i);
+        pte_t * res = __reverse_lookup_pgdir(envs[*env_i].env_pgdir, addr, present, pgdir_i, pte_i);
         if (res)
             return res;
         
@@ -116,7 +121,7 @@ pte_t * reverse_pte_lookup(page_info_t * page, uint64_t * iter) {
     /* Search kernel page directory*/
     if (reverse_pagetable_look_kern) {
         
-        pte_t * res = reverse_pte_lookup_pgdir(kern_pgdir,page, pgdir_i, pte_i);
+        pte_t * res = __reverse_lookup_pgdir(kern_pgdir, addr, present, pgdir_i, pte_i);
         
         if (res)
             return res;
@@ -131,3 +136,18 @@ pte_t * reverse_pte_lookup(page_info_t * page, uint64_t * iter) {
     
     return 0;
 }
+
+/**
+ * Find a pte that references the physical page described by [page]
+ *  This function can be called repeatedly untill it returns 0 for incremental results
+ * @param page the physical page, described by [page], to find
+ * @param iter The non-volatile iterator
+ * @return pte_t pointer if found, 0 if nothing was found
+ */
+pte_t * reverse_pte_lookup(page_info_t * page, uint64_t * iter) {
+    return __reverse_lookup(page2pa(page), PTE_BIT_PRESENT, iter);
+}
+
+pte_t * reverse_swap_pte_lookup(pte_t swapped, uint64_t * iter) {
+    return __reverse_lookup(PTE_GET_PHYS_ADDRESS(swapped), 0, iter);
+}
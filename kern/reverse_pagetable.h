@@ -24,6 +24,15 @@ extern volatile int reverse_pagetable_look_kern;
  */
 pte_t * reverse_pte_lookup(page_info_t * page, uint64_t * iter) ;
 
+/**
+ * Find a swapped out pte that references the same swap slot as [swapped]
+ *  Iterates like reverse_pte_lookup.
+ * @param swapped a non present pte holding a swap id
+ * @param iter The non-volatile iterator
+ * @return pte_t pointer if found, 0 if nothing was found
+ */
+pte_t * reverse_swap_pte_lookup(pte_t swapped, uint64_t * iter);
+
 /**
  * Looksup a given physical page [page] entry in given pagetable [pd]
  *  To enable repeated coninued iterations and returns (yield in python)
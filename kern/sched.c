@@ -1,5 +1,6 @@
 #include "../inc/env.h"
 #include "../inc/x86.h"
+#include "../inc/atomic_ops.h"
 #include "../inc/stdio.h"
 #include "../inc/assert.h"
 #include "cpu.h"
@@ -8,153 +9,638 @@
 #include "pmap.h"
 #include "monitor.h"
 #include "spinlock.h"
-#include "inc/atomic_ops.h"
+#include "waitqueue.h"
+#include "../inc/error.h"
+#include "../inc/string.h"
 
-static uint64_t last_ran = 0;
+/* TSC of the last scheduling decision, per CPU */
+static uint64_t last_ran[NCPU];
 
 void sched_halt(void);
 
-static unsigned long long int shared_sched_iter = 0;
+/*
+ * Per-CPU run queues.
+ *
+ * Every ENV_RUNNABLE env sits in exactly one queue; env_rq holds the
+ * queue's cpu + 1 (0 when not queued). Envs only leave ENV_RUNNABLE under
+ * the lock of the queue they are in, which replaces the compare-and-swap
+ * on env_status the global scan used. Each queue gets its own cache line
+ * so CPUs working on their own queue do not bounce each other's lines.
+ *
+ * A queue is a binary min-heap on env_vruntime (weighted fair
+ * scheduling): the env that got the least CPU time relative to its weight
+ * runs next. env_rq_idx is the env's slot in the heap, so any env can be
+ * taken out in O(log n).
+ *
+ * Real-time (EDF) envs are admitted to one CPU and queue on its rt_list
+ * instead. They are never stolen and run before any fair env while they
+ * have budget left, the one with the earliest deadline first. Admission
+ * keeps the reserved share of each CPU at RT_UTIL_MAX or below, so the
+ * list stays short and is scanned linearly.
+ */
+struct runqueue {
+    struct spinlock lock;
+    uint64_t min_vruntime;      /* Monotonic floor for (re)queued envs */
+    volatile uint32_t len;      /* Fair envs in heap */
+    struct env *rt_list;        /* Queued EDF envs, unordered */
+    struct env *heap[NENV];
+} __attribute__ ((aligned (64)));
+
+static struct runqueue runqueues[NCPU];
+
+/* Permille of a CPU that EDF envs may reserve, the rest is for fair envs */
+#define RT_UTIL_MAX 900
+
+/* Reserved permille per CPU, under rt_admit_lock */
+static uint32_t rt_util[NCPU];
+static struct spinlock rt_admit_lock;
+
+/* Weight per nice level (-20..19), each level is ~1.25x the next */
+static const uint32_t nice_weights[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+static void rq_set(struct runqueue *rq, uint32_t i, struct env *e) {
+    rq->heap[i] = e;
+    e->env_rq_idx = i;
+}
+
+static void rq_sift_up(struct runqueue *rq, uint32_t i) {
+    struct env *e = rq->heap[i];
+    uint32_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (rq->heap[parent]->env_vruntime <= e->env_vruntime)
+            break;
+        rq_set(rq, i, rq->heap[parent]);
+        i = parent;
+    }
+    rq_set(rq, i, e);
+}
+
+static void rq_sift_down(struct runqueue *rq, uint32_t i) {
+    struct env *e = rq->heap[i];
+    uint32_t child;
+
+    while ((child = 2 * i + 1) < rq->len) {
+        if (child + 1 < rq->len &&
+                rq->heap[child + 1]->env_vruntime < rq->heap[child]->env_vruntime)
+            child++;
+        if (e->env_vruntime <= rq->heap[child]->env_vruntime)
+            break;
+        rq_set(rq, i, rq->heap[child]);
+        i = child;
+    }
+    rq_set(rq, i, e);
+}
+
+/* Adds e to rq, rq must be locked */
+static void rq_push(struct runqueue *rq, struct env *e) {
+    e->env_rq = (rq - runqueues) + 1;
+
+    if (e->env_rt.period) {
+        e->env_rt.next = rq->rt_list;
+        rq->rt_list = e;
+        return;
+    }
+
+    assert(rq->len < NENV);
+    rq_set(rq, rq->len++, e);
+    rq_sift_up(rq, e->env_rq_idx);
+}
+
+/* Removes e from rq, rq must be locked and contain e */
+static void rq_unlink(struct runqueue *rq, struct env *e) {
+    uint32_t i = e->env_rq_idx;
+    struct env *last, **link;
+
+    if (e->env_rt.period) {
+        for (link = &rq->rt_list; *link != e; link = &(*link)->env_rt.next)
+            assert(*link);
+        *link = e->env_rt.next;
+        e->env_rt.next = NULL;
+        e->env_rq = 0;
+        return;
+    }
+
+    last = rq->heap[--rq->len];
+
+    /* Fill the hole with the last leaf and restore the heap around it */
+    if (last != e) {
+        rq_set(rq, i, last);
+        rq_sift_up(rq, i);
+        rq_sift_down(rq, last->env_rq_idx);
+    }
+    e->env_rq = 0;
+}
+
+/* Whether e may run on cpu (affinity) */
+static int sched_allowed(struct env *e, int cpu) {
+    return (e->env_affinity >> cpu) & 1;
+}
+
+/* Takes e from rq for this CPU (ENV_RUNNING), rq must be locked */
+static void rq_claim(struct runqueue *rq, struct env *e) {
+    rq_unlink(rq, e);
+    assert(e->env_status == ENV_RUNNABLE);
+    if (e->env_runs && e->env_cpunum != cpunum())
+        e->env_migrations++;
+    /* CPU before status, see sched_curenv_ours */
+    e->env_cpunum = cpunum();
+    sync_synchronize();
+    e->env_status = ENV_RUNNING;
+}
+
+int sched_curenv_ours(void) {
+    volatile struct env *cur = curenv;
+
+    /* rq_claim stores the CPU first, so RUNNING here implies its CPU */
+    return cur && cur->env_status == ENV_RUNNING && cur->env_cpunum == cpunum();
+}
+
+/**
+ * Takes the env with the lowest vruntime that may run on this CPU from rq
+ * and claims it (ENV_RUNNING)
+ * @param rq the run queue, unlocked
+ * @return the env to run, NULL if the queue had none
+ */
+static struct env *rq_pop(struct runqueue *rq) {
+    struct env *e = NULL;
+    uint32_t i;
+
+    /* Racy peek, saves the lock on empty queues */
+    if (!rq->len)
+        return NULL;
+
+    spin_lock(&rq->lock);
+    if (rq->len) {
+        e = rq->heap[0];
+        /* Only when stealing: find the best env we may take instead */
+        if (!sched_allowed(e, cpunum())) {
+            e = NULL;
+            for (i = 1; i < rq->len; i++)
+                if (sched_allowed(rq->heap[i], cpunum()) &&
+                        (!e || rq->heap[i]->env_vruntime < e->env_vruntime))
+                    e = rq->heap[i];
+        }
+    }
+    if (e) {
+        rq_claim(rq, e);
+        if (e->env_vruntime > rq->min_vruntime)
+            rq->min_vruntime = e->env_vruntime;
+    }
+    spin_unlock(&rq->lock);
+
+    return e;
+}
 
 /**
- * function handles increment and returns current iterator
- * @return iterator before atomic increment
+ * Starts a new period for e if its deadline has passed.
+ * @param e an EDF env
+ * @param now current TSC
+ * @param wanted whether e was runnable up to now, so that budget left at
+ *  the deadline counts as a miss
  */
-unsigned long long int shared_sched_get_next_iter() {
-    return sync_fetch_and_add(&shared_sched_iter, (long long int)1);
+static void rt_replenish(struct env *e, uint64_t now, int wanted) {
+    struct env_rt *rt = &e->env_rt;
+    uint64_t n;
+
+    if (now < rt->deadline)
+        return;
+
+    /* Periods that passed, the ones after the first got no CPU at all */
+    n = (now - rt->deadline) / rt->period + 1;
+    if (wanted)
+        rt->misses += rt->budget ? n : n - 1;
+    rt->periods += n;
+    rt->deadline += n * rt->period;
+    rt->budget = rt->runtime;
 }
 
 /**
- * This is the counter part of shared_sched_yield_env
- * checks if env status is runnable
- *  if true, sets status to running and returns true
- *  if not, leaves status and returns false
- * @param env the enviroment (env_t) object
- * @return true on setting status to ENV_RUNNING from ENV_RUNNABLE
+ * Looks for the EDF env to run next, starting new periods on the way.
+ * @param rq the run queue, locked
+ * @param now current TSC
+ * @param wake lowered to the next period start of an env without budget
+ * @return the queued env with budget and the earliest deadline, or NULL
  */
-int shared_sched_do_run(env_t * env) {
-    return sync_bool_compare_and_swap(&env->env_status, ENV_RUNNABLE, ENV_RUNNING);
+static struct env *rt_scan(struct runqueue *rq, uint64_t now, uint64_t *wake) {
+    struct env *e, *best = NULL;
+
+    for (e = rq->rt_list; e; e = e->env_rt.next) {
+        rt_replenish(e, now, 1);
+        if (!e->env_rt.budget) {
+            if (e->env_rt.deadline < *wake)
+                *wake = e->env_rt.deadline;
+        } else if (!best || e->env_rt.deadline < best->env_rt.deadline)
+            best = e;
+    }
+
+    return best;
 }
+
 /**
- * This is the counter part of shared_sched_do_run
- * checks if env status is running
- *  if true, sets status to runnable and returns true
- *  if not, leaves status and returns false
- * @param env the enviroment (env_t) object
- * @return true on setting status to ENV_RUNNABLE from ENV_RUNNING
+ * Takes the EDF env that is due from rq and claims it for this CPU
+ * @param rq the run queue, unlocked
+ * @param now current TSC
+ * @param wake lowered to the next period start of an env without budget
+ * @return the env to run, NULL if no EDF env has budget left
  */
-int shared_sched_yield_env(env_t * env) {
-    return sync_bool_compare_and_swap(&env->env_status, ENV_RUNNING, ENV_RUNNABLE);
+static struct env *rt_pop(struct runqueue *rq, uint64_t now, uint64_t *wake) {
+    struct env *e;
+
+    if (!rq->rt_list)
+        return NULL;
+
+    spin_lock(&rq->lock);
+    if ((e = rt_scan(rq, now, wake)))
+        rq_claim(rq, e);
+    spin_unlock(&rq->lock);
+
+    return e;
 }
-/*
- * Choose a user environment to run and run it.
+
+/**
+ * Steals the first env that may run here from the longest run queue of
+ * another CPU. Lengths are read without locks, a stale pick just costs a
+ * retry on the next yield.
+ * @return the env to run, NULL if all other queues are empty
  */
-void sched_yield(void)
-{
-    struct env *idle;
-    int curenv_i = 0, env_i, i;
+static struct env *rq_steal(void) {
+    struct runqueue *busiest = NULL, *local = &runqueues[cpunum()];
+    struct env *e;
+    uint32_t len, max = 0;
+    int i;
+
+    for (i = 0; i < ncpu; i++) {
+        len = runqueues[i].len;
+        if (i != cpunum() && len > max) {
+            max = len;
+            busiest = &runqueues[i];
+        }
+    }
+
+    if (!busiest || !(e = rq_pop(busiest)))
+        return NULL;
+
+    /* vruntimes of different queues are unrelated, start at our floor */
+    spin_lock(&local->lock);
+    e->env_vruntime = local->min_vruntime;
+    spin_unlock(&local->lock);
+
+    return e;
+}
+
+/**
+ * Charges delta cycles of CPU time to e, scaled by its weight
+ * @param e the env that ran
+ * @param delta TSC cycles
+ */
+static void sched_account(struct env *e, uint64_t delta) {
+    /* Keep the product within 64 bits: (2^32 - 1) * (2^26 / 15) < 2^55 */
+    if (delta > 0xffffffffULL)
+        delta = 0xffffffffULL;
+
+    e->env_vruntime += (delta * ((NICE_0_WEIGHT << 16) / e->env_weight)) >> 16;
+}
+
+/**
+ * Charges delta cycles of CPU time to the budget of EDF env e
+ * @param e the env that ran
+ * @param now current TSC
+ * @param delta TSC cycles
+ */
+static void rt_charge(struct env *e, uint64_t now, uint64_t delta) {
+    e->env_rt.budget -= MIN(e->env_rt.budget, delta);
+    rt_replenish(e, now, 1);
+}
+
+/* Makes this CPU's timer fire at TSC 'when' (~0: never) */
+static void sched_timer(uint64_t now, uint64_t when) {
+    if (when == ~0ULL)
+        lapic_timer_disarm();
+    else
+        lapic_timer_arm(when > now ? when - now : 1);
+}
+
+/**
+ * Moves e, the env running on this CPU, into the EDF class with a budget
+ * of runtime cycles every period cycles, or back to the fair class if
+ * runtime is 0. The reservation is admitted to the CPU (within e's
+ * affinity) with the least reserved time it fits on, e runs on that CPU
+ * only.
+ * @param e curenv
+ * @param runtime budget per period, 0 to leave the EDF class
+ * @param period length of a period
+ * @return 0 on success, -E_INVAL on bad parameters, -E_NO_CPU if no CPU
+ *  has the time left
+ */
+int sched_set_realtime(struct env *e, uint64_t runtime, uint64_t period) {
+    uint32_t util = 0;
+    int cpu = -1, i;
+
+    if (runtime) {
+        if (runtime > period)
+            return -E_INVAL;
+        util = (runtime * 1000 + period - 1) / period;
+    }
+
+    spin_lock(&rt_admit_lock);
+    /* The old reservation is replaced, not added to */
+    if (e->env_rt.period)
+        rt_util[e->env_rt.cpu] -= e->env_rt.util;
+    if (util) {
+        for (i = 0; i < ncpu; i++)
+            if (sched_allowed(e, i) && rt_util[i] + util <= RT_UTIL_MAX &&
+                    (cpu < 0 || rt_util[i] < rt_util[cpu]))
+                cpu = i;
+        if (cpu < 0) {
+            if (e->env_rt.period)
+                rt_util[e->env_rt.cpu] += e->env_rt.util;
+            spin_unlock(&rt_admit_lock);
+            return -E_NO_CPU;
+        }
+        rt_util[cpu] += util;
+    }
+    spin_unlock(&rt_admit_lock);
+
+    memset(&e->env_rt, 0, sizeof(e->env_rt));
+    if (util) {
+        e->env_rt.runtime = runtime;
+        e->env_rt.period = period;
+        e->env_rt.deadline = read_tsc() + period;
+        e->env_rt.budget = runtime;
+        e->env_rt.util = util;
+        e->env_rt.cpu = cpu;
+    }
+    return 0;
+}
+
+/**
+ * Sets the nice value of e, lower is a larger share of CPU time
+ * @param e the env
+ * @param nice NICE_MIN .. NICE_MAX
+ * @return 0 on success, -E_INVAL on a bad nice value
+ */
+int sched_set_nice(struct env *e, int nice) {
+    if (nice < NICE_MIN || nice > NICE_MAX)
+        return -E_INVAL;
+
+    e->env_nice = nice;
+    e->env_weight = nice_weights[nice - NICE_MIN];
+    return 0;
+}
+
+/**
+ * Picks the queue e is woken onto: the CPU it was admitted to (EDF), else
+ * the CPU it last ran on while its cache and TLB are warm, else this CPU.
+ * A busy last CPU is fine, idle CPUs steal from it.
+ * @param e the env
+ * @return a run queue of a CPU e may run on
+ */
+static struct runqueue *sched_home(struct env *e) {
+    int i;
+
+    if (e->env_rt.period)
+        return &runqueues[e->env_rt.cpu];
+    if (e->env_runs && e->env_cpunum < ncpu && sched_allowed(e, e->env_cpunum))
+        return &runqueues[e->env_cpunum];
+    if (sched_allowed(e, cpunum()))
+        return &runqueues[cpunum()];
+
+    for (i = 0; i < ncpu - 1 && !sched_allowed(e, i); i++)
+        ;
+    return &runqueues[i];
+}
+
+/**
+ * Restricts e to the CPUs in mask (bit i for CPU i). A queued env moves
+ * to a CPU it may run on, a running one when it next yields. EDF envs
+ * must keep the CPU they were admitted to.
+ * @param e the env
+ * @param mask CPUs e may run on
+ * @return 0 on success, -E_INVAL if mask has no CPU or drops the EDF one
+ */
+int sched_set_affinity(struct env *e, uint32_t mask) {
+    mask &= (1U << ncpu) - 1;
+    if (!mask)
+        return -E_INVAL;
+    if (e->env_rt.period && !((mask >> e->env_rt.cpu) & 1))
+        return -E_INVAL;
+
+    e->env_affinity = mask;
+    if (e->env_rq && !sched_allowed(e, e->env_rq - 1) && sched_remove(e))
+        sched_wakeup(e);
+    return 0;
+}
+
+/**
+ * Wakes up a halted CPU with a reschedule IPI. Whoever flips its status
+ * back to CPU_STARTED sends the IPI, so a CPU gets kicked only once.
+ * @param cpu index into cpus[]
+ * @return 1 if cpu was halted
+ */
+static int sched_kick(int cpu) {
+    if (cpu == cpunum() || cpus[cpu].cpu_status != CPU_HALTED ||
+            xchg(&cpus[cpu].cpu_status, CPU_STARTED) != CPU_HALTED)
+        return 0;
+
+    lapic_ipi_cpu(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+    return 1;
+}
+
+/**
+ * Marks e ENV_RUNNABLE and queues it, see sched_home.
+ * Use this instead of setting ENV_RUNNABLE directly (wakeup, fork, ...).
+ * @param e env which is not running and not queued
+ */
+void sched_wakeup(struct env *e) {
+    struct runqueue *rq = sched_home(e);
+    int cpu = rq - runqueues, i;
+
+    assert(!e->env_rq);
+
+    spin_lock(&rq->lock);
+    /* No credit for time spent asleep (or never having run) */
+    if (e->env_rt.period)
+        rt_replenish(e, read_tsc(), 0);
+    else if (e->env_vruntime < rq->min_vruntime)
+        e->env_vruntime = rq->min_vruntime;
+    e->env_status = ENV_RUNNABLE;
+    rq_push(rq, e);
+    spin_unlock(&rq->lock);
 
     /*
-     * Implement simple round-robin scheduling.
-     *
-     * Search through 'envs' for an ENV_RUNNABLE environment in
-     * circular fashion starting just after the env this CPU was
-     * last running.  Switch to the first such environment found.
-     *
-     * If no envs are runnable, but the environment previously
-     * running on this CPU is still ENV_RUNNING, it's okay to
-     * choose that environment.
-     *
-     * Never choose an environment that's currently running (on
-     * another CPU, if we had, ie., env_status == ENV_RUNNING). 
-     * If there are
-     * no runnable environments, simply drop through to the code
-     * below to halt the cpu.
+     * The unlock (xchg) orders the push before reading cpu_status: either
+     * a halting CPU sees e in its last look, or we see it CPU_HALTED.
+     * Wake the home CPU, or else a halted one that may steal e.
      */
+    if (sched_kick(cpu) || e->env_rt.period)
+        return;
+    for (i = 0; i < ncpu; i++)
+        if (sched_allowed(e, i) && sched_kick(i))
+            return;
+}
 
+/**
+ * Takes e off its run queue, setting it ENV_NOT_RUNNABLE.
+ * A CPU might pick e up while we get here, in which case e is left alone
+ * and will be ENV_RUNNING.
+ * @param e the env
+ * @return 1 if e was dequeued, 0 if it was not queued (anymore)
+ */
+int sched_remove(struct env *e) {
+    struct runqueue *rq;
+    int q;
+
+    /* e may move between queues (stealing) while we grab the lock */
+    while ((q = e->env_rq)) {
+        rq = &runqueues[q - 1];
+        spin_lock(&rq->lock);
+        if (e->env_rq == q) {
+            rq_unlink(rq, e);
+            e->env_status = ENV_NOT_RUNNABLE;
+            spin_unlock(&rq->lock);
+            return 1;
+        }
+        spin_unlock(&rq->lock);
+    }
+
+    return 0;
+}
+
+/*
+ * Choose a user environment to run and run it.
+ */
+void sched_yield(void)
+{
     /**************************************
      * Multi-core rules                   *
      **************************************
      * 1. Never touch a env with ENV_RUNNING
      *    Enviroments with ENV_RUNNING are considered locked
-     *    The owner is considered the core with the env as curenv
-     * 2. Only change env status using shared_sched_do_run(...)
-     *    shared_sched_do_run changes state to ENV_RUNNING if it is ENV_RUNNABLE
-     * 3. Use global iterator, only via shared_sched_get_next_iter()
+     *    The owner is the core that took it from a run queue
+     * 2. Only make envs runnable using sched_wakeup(...)
+     * 3. Runnable envs are only claimed under their run queue lock
      ***************************************/
 
-
     volatile int cpun = cpunum();
-    volatile struct cpuinfo *curcpu = thiscpu;
     volatile struct env *cur = curenv; /* For IDE autocompletion, macro unfolding is b0rked */
-    uint64_t since_last_yield = read_tsc() - last_ran;
-    last_ran = read_tsc();
+    struct runqueue *rq = &runqueues[cpun];
+    struct env *next, *rt;
+    uint64_t now = read_tsc();
+    uint64_t since_last_yield = now - last_ran[cpun];
+    uint64_t wake = ~0ULL;
+    last_ran[cpun] = now;
 
-    dprintf("curcpu %p curcpuenv %p curenv %p\n", curcpu, curcpu->cpu_env, curenv);
+    dprintf("curcpu %d curenv %p\n", cpun, curenv);
 
     /*
-     * If we have a current enviroment
-     * It is considered locked for us!
+     * If we have a current enviroment which still is ours, it is
+     * considered locked for us! (A woken env might have been picked up by
+     * another CPU before we left it.)
      */
-    if(curenv) {
-        curenv_i = (curenv - envs);
-        /* If current env has CPU time left in its slice, run it again */
-        if(cur->env_status == ENV_RUNNING && (cur->remain_cpu_time > since_last_yield)) {
+    if (sched_curenv_ours()) {
+        if (cur->env_rt.period)
+            rt_charge(curenv, now, since_last_yield);
+        else
+            sched_account(curenv, since_last_yield);
+
+        /* Queued EDF envs that are due take precedence */
+        rt = NULL;
+        if (rq->rt_list) {
+            spin_lock(&rq->lock);
+            rt = rt_scan(rq, now, &wake);
+            spin_unlock(&rq->lock);
+        }
+
+        /* An EDF env runs on while it has budget and the earliest deadline */
+        if (cur->env_rt.period && cur->env_rt.budget &&
+                (!rt || rt->env_rt.deadline >= cur->env_rt.deadline)) {
+            sched_timer(now, MIN(wake, now + cur->env_rt.budget));
+            env_run(curenv);
+        }
+
+        /* If current env has CPU time left in its slice, run it again
+         * (unless its affinity no longer includes us) */
+        if (!cur->env_rt.period && !rt && cur->remain_cpu_time > since_last_yield &&
+                sched_allowed(curenv, cpun)) {
             cur->remain_cpu_time -= since_last_yield;
             dprintf("------------> Continuing %s (%d) at %p (CPU %d) remaining time: %u\n",
                     cur->env_tf.tf_cs == GD_KT ? "kernel env" : "user env",
                     cur->env_id,
                     cur->env_tf.tf_eip,
-                    thiscpu->cpu_id,
+                    cpun,
                     cur->remain_cpu_time
                     );
+            sched_timer(now, MIN(wake, now + cur->remain_cpu_time));
             env_run(curenv);
-        } else {
-            cur->remain_cpu_time = MAX_TIME_SLICE;
-            dprintf("------------> End of Timeslice %d at %p\n", curenv->env_id, curenv->env_tf.tf_eip);
         }
+
+        /* End of its slice (or budget), back into a queue. sys_yield
+         * empties the slice to give up the CPU. */
+        env_charge(curenv, 0);
+        if (cur->remain_cpu_time)
+            cur->env_rusage.ru_nivcsw++;
+        else
+            cur->env_rusage.ru_nvcsw++;
+        cur->remain_cpu_time = MAX_TIME_SLICE;
+        dprintf("------------> End of Timeslice %d at %p\n", curenv->env_id, curenv->env_tf.tf_eip);
+        sched_wakeup(curenv);
     } else {
         dprintf("No current env\n");
     }
 
-    /* Iterates over envs, starting at curenv's index, wrapping
-     * around NENVS to 0, and from there up to curenv's index. */
-    for(i = 0; i < NENV; i++) {
-        env_i = shared_sched_get_next_iter() % NENV;
-        idle = &envs[env_i];
-
-        /* Try to acquire lock (tests if runnable) */
-        if(idle && shared_sched_do_run(idle)) {
-            /* Free environment from our grasp by setting ENV_RUNNING to ENV_RUNNABLE */
-            /* Enviroment might be dying though... */
-            if (curenv) {
-                if (curenv->env_status == ENV_RUNNING)
-                    if (shared_sched_yield_env(curenv)==0)
-                        panic("Yielding failed! Must never happen!");
-            }
-
-            /* Run new curenv */
-            dprintf("------------> running %s (%d) at %p (CPU %d).\n",
-                    idle->env_tf.tf_cs == GD_KT ? "kernel env" : "user env",
-                    idle->env_id,
-                    idle->env_tf.tf_eip,
-                    thiscpu->cpu_id
-                    );
-            assert(idle->env_tf.tf_eip);
-            env_run(idle);
-        }
+    /*
+     * EDF envs that are due, then the lowest vruntime of our own queue,
+     * otherwise help out the busiest CPU. Finding nothing, mark this CPU
+     * CPU_HALTED and look once more, so that a concurrent sched_wakeup
+     * either gets seen here or sends us a reschedule IPI.
+     */
+    wake = ~0ULL;
+    for (;;) {
+        next = rt_pop(rq, now, &wake);
+        if (!next)
+            next = rq_pop(rq);
+        if (!next)
+            next = rq_steal();
+        if (next || thiscpu->cpu_status == CPU_HALTED)
+            break;
+        xchg(&thiscpu->cpu_status, CPU_HALTED);
     }
 
-    /* If no eligible envs found above, we can continue running curenv if it is still marked as running */
-    if(curenv && curenv->env_status == ENV_RUNNING) {
-        dprintf("------------> continue %d at %p (CPU %d).\n",
-                    curenv->env_id,
-                    curenv->env_tf.tf_eip,
-                    thiscpu->cpu_id
-                    );
-        env_run(curenv);
+    if (next) {
+        /* A waker may have beaten us to it, then an IPI is on its way */
+        if (thiscpu->cpu_status == CPU_HALTED)
+            xchg(&thiscpu->cpu_status, CPU_STARTED);
+        dprintf("------------> running %s (%d) at %p (CPU %d).\n",
+                next->env_tf.tf_cs == GD_KT ? "kernel env" : "user env",
+                next->env_id,
+                next->env_tf.tf_eip,
+                cpun
+                );
+        assert(next->env_tf.tf_eip);
+        next->env_charged = now;
+        if (next->env_rt.period)
+            wake = MIN(wake, now + next->env_rt.budget);
+        else
+            wake = MIN(wake, now + next->remain_cpu_time);
+        sched_timer(now, wake);
+        env_run(next);
     }
 
+    /* Idle: wake up for the next period of a throttled EDF env, if any.
+     * Anything else that becomes runnable arrives by IPI. */
+    sched_timer(now, wake);
+
     /* sched_halt never returns */
     dprintf("Running sched_halt()\n");
     sched_halt();
@@ -164,24 +650,36 @@ void sched_yield(void)
 }
 
 /*
- * Halt this CPU when there is nothing to do. Wait until the timer interrupt
- * wakes it up. This function never returns.
+ * Whether nothing in the system can run anymore: every run queue is empty,
+ * no other CPU runs an env and no env waits for an event. O(CPUS) instead
+ * of a scan over envs[].
  */
-void sched_halt(void)
+static int sched_system_idle(void)
 {
     int i;
 
+    if (wait_nwaiting)
+        return 0;
+
+    for (i = 0; i < ncpu; i++) {
+        if (runqueues[i].len || runqueues[i].rt_list)
+            return 0;
+        if (i != cpunum() && cpus[i].cpu_env)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Halt this CPU when there is nothing to do. Wait until a reschedule IPI or
+ * the timer interrupt wakes it up. This function never returns.
+ */
+void sched_halt(void)
+{
     /* For debugging and testing purposes, if there are no runnable
      * environments in the system, then drop into the kernel monitor. */
     dprintf("Checking for runnable environments...\n");
-    for (i = 0; i < NENV; i++) {
-        if ((envs[i].env_status == ENV_RUNNABLE ||
-             envs[i].env_status == ENV_RUNNING ||
-             envs[i].env_status == ENV_WAITING ||
-            envs[i].env_status == ENV_DYING))
-            break;
-    }
-    if (i == NENV && cpunum() == 0) {
+    if (cpunum() == 0 && sched_system_idle()) {
         dprintf("No runnable environments in the system!\n");
         while (1)
             monitor(NULL);
@@ -191,10 +689,8 @@ void sched_halt(void)
     curenv = NULL;
     lcr3(PADDR(kern_pgdir));
 
-    /* Mark that this CPU is in the HALT state, so that when
-     * timer interupts come in, we know we should re-acquire the
-     * big kernel lock */
-    xchg(&thiscpu->cpu_status, CPU_HALTED);
+    /* sched_yield marked this CPU CPU_HALTED already, and trap() marks it
+     * CPU_STARTED again on the next interrupt */
 
     /* Release the big kernel lock as if we were "leaving" the kernel */
 //    unlock_kernel();
@@ -6,7 +6,65 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-#define MAX_TIME_SLICE 1000000 /* 1ms on 1GHz CPU */
+#include <kern/kclock.h>
+
+/* Time slice of fair envs in microseconds, set with make SLICE_US=... */
+#ifndef SCHED_SLICE_US
+#define SCHED_SLICE_US 1000
+#endif
+
+#define MAX_TIME_SLICE ((uint32_t) usec_to_tsc(SCHED_SLICE_US)) /* In TSC cycles */
+#define NICE_0_WEIGHT  1024    /* Weight of nice 0 */
+
+struct env;
+
+/**
+ * Marks e ENV_RUNNABLE and puts it on this CPU's run queue
+ * @param e env that is neither running nor queued
+ */
+void sched_wakeup(struct env *e);
+
+/**
+ * Takes e off its run queue (ENV_NOT_RUNNABLE)
+ * @param e the env
+ * @return 1 if dequeued, 0 if e was not queued
+ */
+int sched_remove(struct env *e);
+
+/**
+ * Sets the nice value and with it the weight of e
+ * @param e the env
+ * @param nice NICE_MIN .. NICE_MAX
+ * @return 0 on success, -E_INVAL on a bad nice value
+ */
+int sched_set_nice(struct env *e, int nice);
+
+/**
+ * Moves curenv e into the EDF class (runtime cycles every period cycles)
+ * or back to the fair class (runtime 0)
+ * @param e curenv
+ * @param runtime budget per period
+ * @param period length of a period
+ * @return 0 on success, -E_INVAL on bad parameters, -E_NO_CPU if the
+ *  reservation does not fit on any CPU
+ */
+int sched_set_realtime(struct env *e, uint64_t runtime, uint64_t period);
+
+/**
+ * Restricts e to the CPUs in mask (bit i for CPU i)
+ * @param e the env
+ * @param mask CPUs e may run on
+ * @return 0 on success, -E_INVAL if mask has no existing CPU or leaves out
+ *  the CPU an EDF env was admitted to
+ */
+int sched_set_affinity(struct env *e, uint32_t mask);
+
+/**
+ * Whether curenv still belongs to this CPU. An env that blocked in a trap
+ * may have been woken and run elsewhere before the trap returns.
+ * @return 1 if curenv is ENV_RUNNING on this CPU, 0 otherwise
+ */
+int sched_curenv_ours(void);
 
 /* This function does not return. */
 void sched_yield(void) __attribute__((noreturn));
@@ -0,0 +1,341 @@
+/* 
+ * File:   shm.c
+ *
+ * Shared memory objects.
+ */
+
+#include "shm.h"
+#include "ide.h"
+#include "spinlock.h"
+#include "inc/elf.h"
+#include "inc/assert.h"
+#include "inc/error.h"
+#include "inc/string.h"
+
+#define SHM_SECTORS_PER_PAGE (PGSIZE / SECTSIZE)
+
+static shm_t shm_objects[SHM_MAX_OBJECTS];
+static int32_t shm_next_id = 1;
+static struct spinlock shm_lock = { .locked = 0 };
+
+/* Disk data area on the boot disk */
+static uint32_t shm_disk_first_sector = 0;
+static uint32_t shm_disk_npages = 0;
+
+/**
+ * Transfers n pages from or to the data area, starting at data page page
+ *  Takes the controller for the whole transfer.
+ */
+static void __shm_disk_io(uint32_t page, char **buf, uint32_t n, int write) {
+    assert(n * SHM_SECTORS_PER_PAGE <= 256);
+
+    ide_lock();
+    ide_start_readwrite_disk(IDE_DISK_BOOT,
+            shm_disk_first_sector + page * SHM_SECTORS_PER_PAGE,
+            n * SHM_SECTORS_PER_PAGE, write);
+    for (uint32_t i = 0; i < n * SHM_SECTORS_PER_PAGE; i++) {
+        char *sect = buf[i / SHM_SECTORS_PER_PAGE] + (i % SHM_SECTORS_PER_PAGE) * SECTSIZE;
+        while (!ide_is_ready()) asm volatile("pause");
+        if (write)
+            ide_write_sector(sect);
+        else
+            ide_read_sector(sect);
+    }
+    ide_unlock();
+}
+
+void shm_disk_init() {
+    static char sect[SECTSIZE];
+    struct elf *elf = (struct elf *) sect;
+    uint32_t end, sectors = ide_disk_sectors(IDE_DISK_BOOT);
+    char *buf = sect;
+
+    /* The kernel elf starts at sector 1, right after the boot loader */
+    ide_lock();
+    ide_start_readwrite_disk(IDE_DISK_BOOT, 1, 1, 0);
+    while (!ide_is_ready()) asm volatile("pause");
+    ide_read_sector(buf);
+    ide_unlock();
+
+    if (elf->e_magic != ELF_MAGIC) {
+        cprintf("shm: no kernel image on disk %d, disk objects disabled\n", IDE_DISK_BOOT);
+        return;
+    }
+
+    /* The section headers come last in the file, segments may follow though */
+    end = elf->e_shoff + elf->e_shnum * elf->e_shentsize;
+    if (elf->e_phoff + elf->e_phnum * sizeof(struct elf_proghdr) <= SECTSIZE) {
+        struct elf_proghdr *ph = (struct elf_proghdr *) (sect + elf->e_phoff);
+        for (uint32_t i = 0; i < elf->e_phnum; i++)
+            end = MAX(end, ph[i].p_offset + ph[i].p_filesz);
+    }
+
+    shm_disk_first_sector = 1 + ROUNDUP(end, PGSIZE) / SECTSIZE;
+    if (sectors > shm_disk_first_sector)
+        shm_disk_npages = (sectors - shm_disk_first_sector) / SHM_SECTORS_PER_PAGE;
+
+    cprintf("shm: disk data area at sector %u, %u pages\n",
+            shm_disk_first_sector, shm_disk_npages);
+}
+
+uint32_t shm_disk_pages() {
+    return shm_disk_npages;
+}
+
+/**
+ * Releases all pages of an object and its slot
+ *  Lock must be held.
+ */
+static void __shm_free(shm_t *shm) {
+    for (uint32_t i = 0; i < shm->npages; i++)
+        if (shm->pages[i])
+            page_decref(shm->pages[i]);
+
+    page_decref(pa2page(PADDR(shm->pages)));
+    dprintf("shm: freed object %d\n", shm->id);
+    memset(shm, 0, sizeof(shm_t));
+}
+
+/**
+ * Finds the live disk object for a range
+ *  Lock must be held.
+ */
+static shm_t * __shm_disk_find(uint32_t page, uint32_t npages) {
+    for (uint32_t i = 0; i < SHM_MAX_OBJECTS; i++) {
+        shm_t *shm = &shm_objects[i];
+        if (shm->id && shm->disk && shm->disk_page == page && shm->npages == npages)
+            return shm;
+    }
+
+    return 0;
+}
+
+shm_t * shm_get_disk(uint32_t page, size_t len) {
+    uint32_t npages = ROUNDUP(len, PGSIZE) / PGSIZE;
+    shm_t *shm, *fresh;
+    int id;
+
+    if (page >= shm_disk_npages || npages > shm_disk_npages - page)
+        return 0;
+
+    spin_lock(&shm_lock);
+    if ((shm = __shm_disk_find(page, npages)))
+        shm->refs++;
+    spin_unlock(&shm_lock);
+    if (shm)
+        return shm;
+
+    if ((id = shm_create(len, 0)) < 0)
+        return 0;
+    fresh = shm_lookup(id);
+
+    /* Another cpu may have mapped the range meanwhile, use its object */
+    spin_lock(&shm_lock);
+    if ((shm = __shm_disk_find(page, npages))) {
+        shm->refs++;
+    } else {
+        shm = fresh;
+        shm->disk = 1;
+        shm->disk_page = page;
+    }
+    spin_unlock(&shm_lock);
+
+    /* The handle is not handed out, mappings keep the object alive */
+    shm_destroy(id, 0);
+    if (shm != fresh)
+        shm_decref(fresh);
+
+    return shm;
+}
+
+int shm_create(size_t len, envid_t owner) {
+    uint32_t npages = ROUNDUP(len, PGSIZE) / PGSIZE;
+    shm_t *shm = 0;
+
+    if (!npages || npages > SHM_MAX_PAGES)
+        return -E_INVAL;
+
+    page_info_t *pp = page_alloc(ALLOC_ZERO);
+    if (!pp)
+        return -E_NO_MEM;
+    page_inc_ref(pp);
+
+    spin_lock(&shm_lock);
+    for (uint32_t i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (!shm_objects[i].id) {
+            shm = &shm_objects[i];
+            break;
+        }
+    }
+
+    if (!shm) {
+        spin_unlock(&shm_lock);
+        page_decref(pp);
+        return -E_NO_MEM;
+    }
+
+    /* Handles are never reused, so stale handles cannot hit a new object */
+    shm->id = shm_next_id++;
+    shm->npages = npages;
+    shm->refs = 1;
+    shm->destroyed = 0;
+    shm->disk = 0;
+    shm->disk_page = 0;
+    shm->owner = owner;
+    shm->pages = page2kva(pp);
+    spin_unlock(&shm_lock);
+
+    dprintf("shm: created object %d (%d pages)\n", shm->id, npages);
+    return shm->id;
+}
+
+shm_t * shm_lookup(int id) {
+    shm_t *shm = 0;
+
+    if (id <= 0)
+        return 0;
+
+    spin_lock(&shm_lock);
+    for (uint32_t i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (shm_objects[i].id == id && !shm_objects[i].destroyed) {
+            shm = &shm_objects[i];
+            shm->refs++;
+            break;
+        }
+    }
+    spin_unlock(&shm_lock);
+
+    return shm;
+}
+
+int shm_destroy(int id, envid_t envid) {
+    shm_t *shm = shm_lookup(id);
+    if (!shm)
+        return -E_INVAL;
+
+    if (envid && shm->owner != envid) {
+        shm_decref(shm);
+        return -E_BAD_ENV;
+    }
+
+    spin_lock(&shm_lock);
+    if (shm->destroyed) {
+        /* Lost a race with another destroy */
+        spin_unlock(&shm_lock);
+        shm_decref(shm);
+        return -E_INVAL;
+    }
+    shm->destroyed = 1;
+    spin_unlock(&shm_lock);
+
+    /* Drop the lookup and the handle reference */
+    shm_decref(shm);
+    shm_decref(shm);
+    return 0;
+}
+
+void shm_destroy_owned(envid_t envid) {
+    int32_t id;
+
+    for (uint32_t i = 0; i < SHM_MAX_OBJECTS; i++) {
+        /* Racy peek, shm_destroy rechecks under the lock */
+        id = shm_objects[i].id;
+        if (id && shm_objects[i].owner == envid && !shm_objects[i].destroyed)
+            shm_destroy(id, envid);
+    }
+}
+
+void shm_incref(shm_t *shm) {
+    spin_lock(&shm_lock);
+    assert(shm->refs);
+    shm->refs++;
+    spin_unlock(&shm_lock);
+}
+
+void shm_decref(shm_t *shm) {
+    spin_lock(&shm_lock);
+    assert(shm->refs);
+    if (--shm->refs == 0)
+        __shm_free(shm);
+    spin_unlock(&shm_lock);
+}
+
+/**
+ * Reads page pgoff of a disk object and the missing pages after it
+ *  The read runs without shm_lock, pages read twice are dropped again.
+ */
+static page_info_t * __shm_disk_fill(shm_t *shm, uint32_t pgoff) {
+    page_info_t *run[SHM_DISK_READAHEAD];
+    char *buf[SHM_DISK_READAHEAD];
+    uint32_t n;
+
+    for (n = 0; n < SHM_DISK_READAHEAD && pgoff + n < shm->npages; n++) {
+        if (n && shm->pages[pgoff + n])
+            break;
+        if (!(run[n] = page_alloc(0)))
+            break;
+        buf[n] = page2kva(run[n]);
+    }
+    if (!n)
+        return 0;
+
+    __shm_disk_io(shm->disk_page + pgoff, buf, n, 0);
+
+    spin_lock(&shm_lock);
+    for (uint32_t i = 0; i < n; i++) {
+        if (shm->pages[pgoff + i]) {
+            page_free(run[i]);
+            continue;
+        }
+        page_inc_ref(run[i]);
+        shm->pages[pgoff + i] = run[i];
+    }
+    page_info_t *pp = shm->pages[pgoff];
+    spin_unlock(&shm_lock);
+
+    return pp;
+}
+
+void shm_writeback(shm_t *shm, uint32_t pgoff) {
+    page_info_t *pp;
+    char *buf;
+
+    if (!shm->disk || pgoff >= shm->npages || !(pp = shm->pages[pgoff]))
+        return;
+
+    buf = page2kva(pp);
+    __shm_disk_io(shm->disk_page + pgoff, &buf, 1, 1);
+}
+
+page_info_t * shm_page(shm_t *shm, uint32_t pgoff) {
+    page_info_t *pp;
+
+    if (pgoff >= shm->npages)
+        return 0;
+
+    if (shm->disk)
+        return shm->pages[pgoff] ? shm->pages[pgoff] : __shm_disk_fill(shm, pgoff);
+
+    spin_lock(&shm_lock);
+    pp = shm->pages[pgoff];
+    if (!pp) {
+        pp = page_alloc(ALLOC_ZERO);
+        if (pp) {
+            page_inc_ref(pp);
+            shm->pages[pgoff] = pp;
+        }
+    }
+    spin_unlock(&shm_lock);
+
+    return pp;
+}
+
+uint32_t shm_count() {
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < SHM_MAX_OBJECTS; i++)
+        if (shm_objects[i].id)
+            n++;
+
+    return n;
+}
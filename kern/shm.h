@@ -0,0 +1,126 @@
+/* 
+ * File:   shm.h
+ *
+ * Shared memory objects. A shared object is a set of pages which is mapped
+ * writable into every env that maps it, the pages are never copied on write.
+ * Objects are addressed by a handle and live until their handle is
+ * destroyed and the last vma mapping them is gone. Only the env that
+ * created a handle may destroy it, its handles go when it is freed.
+ *
+ * Disk objects cache a page range of the data area on the boot disk (the
+ * sectors past the kernel image). Pages are read on first touch, together
+ * with the following pages, and dirty pages are written back by the vma
+ * layer on sync and unmap.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+#include "inc/memlayout.h"
+#include "inc/env.h"
+#include "pmap.h"
+
+/* Maximum number of shared objects */
+#define SHM_MAX_OBJECTS 64
+/* Maximum pages per object (the page pointers fill one page) */
+#define SHM_MAX_PAGES (PGSIZE / sizeof(page_info_t *))
+/* Pages read with a disk object fault, including the faulting one */
+#define SHM_DISK_READAHEAD 8
+
+typedef struct shm {
+    int32_t id;             /* handle, 0 marks a free slot */
+    uint32_t npages;
+    uint32_t refs;          /* vma's mapping the object + 1 while the handle lives */
+    uint8_t destroyed;      /* handle no longer resolves */
+    uint8_t disk;           /* pages are cached from the disk data area */
+    envid_t owner;          /* env that may destroy the handle, 0 for the kernel */
+    uint32_t disk_page;     /* first page of the object in the data area */
+    page_info_t **pages;    /* allocated on first touch */
+} shm_t;
+
+/**
+ * Creates a shared object of len bytes (rounded up to pages)
+ *  Pages are allocated on first touch.
+ * @param len
+ * @param owner env owning the handle, 0 for the kernel
+ * @return handle (> 0), -E_INVAL on bad size, -E_NO_MEM if no object is left
+ */
+int shm_create(size_t len, envid_t owner);
+
+/**
+ * Locates the disk data area past the kernel image, call after ide_init
+ */
+void shm_disk_init();
+
+/**
+ * Returns the number of pages in the disk data area
+ */
+uint32_t shm_disk_pages();
+
+/**
+ * Gets the object caching len bytes of the disk data area, so that all
+ *  mappings of the same range share their pages. Creates it (without a
+ *  handle) if the range is not mapped yet.
+ * @param page first page in the data area
+ * @param len
+ * @return the object with a reference for the caller, 0 on a bad range or
+ *  when no object is left
+ */
+shm_t * shm_get_disk(uint32_t page, size_t len);
+
+/**
+ * Writes page pgoff of a disk object back to disk, no-op for other objects
+ *  or pages which were never read.
+ * @param shm
+ * @param pgoff
+ */
+void shm_writeback(shm_t *shm, uint32_t pgoff);
+
+/**
+ * Looks up a live shared object and takes a reference on it
+ *  The caller drops it with shm_decref, so the object cannot vanish in between.
+ * @param id handle returned by shm_create
+ * @return the object, 0 if the handle is unknown or destroyed
+ */
+shm_t * shm_lookup(int id);
+
+/**
+ * Destroys the handle, the object is freed after its last vma is unmapped
+ * @param id
+ * @param envid env asking, 0 for the kernel (may destroy any handle)
+ * @return 0 on success, -E_INVAL on an unknown handle, -E_BAD_ENV if
+ *  envid does not own it
+ */
+int shm_destroy(int id, envid_t envid);
+
+/**
+ * Destroys all handles owned by envid, called when the env is freed
+ * @param envid
+ */
+void shm_destroy_owned(envid_t envid);
+
+/**
+ * Takes a reference on behalf of a vma mapping the object
+ */
+void shm_incref(shm_t *shm);
+
+/**
+ * Drops a vma reference, frees the object and its pages on the last one
+ */
+void shm_decref(shm_t *shm);
+
+/**
+ * Returns page pgoff of the object, allocating it on first use
+ *  Disk objects read it (and up to SHM_DISK_READAHEAD - 1 pages after it).
+ *  The object keeps its own reference to the page.
+ * @param shm
+ * @param pgoff page index in the object
+ * @return the page, 0 when out of range or out of memory
+ */
+page_info_t * shm_page(shm_t *shm, uint32_t pgoff);
+
+/**
+ * Returns the number of live objects
+ */
+uint32_t shm_count();
+
+#endif /* SHM_H */
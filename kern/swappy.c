@@ -15,6 +15,8 @@
 #include "reverse_pagetable.h"
 #include "vma.h"
 #include "trap.h"
+#include "sched.h"
+#include "waitqueue.h"
 
 typedef struct {
     void * fault_va;
@@ -23,7 +25,7 @@ typedef struct {
 
 /* swapped id Page structures */
 typedef struct {
-    volatile uint8_t ref; /* Set SWAPPY_REF_BIT_SIZE acordingly */
+    volatile uint16_t ref; /* Set SWAPPY_REF_BIT_SIZE acordingly */
 } __attribute__ ((packed)) swappy_swap_descriptor;
 
 #define swappy_lock_aquire(LOCK) while(!sync_val_compare_and_swap(&LOCK, 0, 1)) asm volatile("pause"); sync_barrier()
@@ -38,7 +40,7 @@ typedef struct {
 
 /* number of bits for REF in swappy_swap_descriptor */
 //Max references to a single swapped page = 2<<(SWAPPY_REF_BIT_SIZE - 1) -1
-#define SWAPPY_REF_BIT_SIZE 8
+#define SWAPPY_REF_BIT_SIZE 16
 
 
 /* Swappy descriptor (memory that describes what is on the swap disk) */
@@ -54,6 +56,9 @@ static uint32_t swappy_queue_poslock_out = 0;
 static volatile uint32_t swappy_queue_read_pos_out = 0;
 static volatile uint32_t swappy_queue_items_out = 0;
 
+/* Envs waiting for the swap in thread, woken one by one as their page arrives */
+struct waitqueue swappy_swapin_wq;
+
 /* Swappy queue which holds pages to be swapped in */
 static swappy_swapin_task * swappy_swap_queue_in = 0;
 static uint32_t swappy_queue_poslock_in = 0;
@@ -159,31 +164,40 @@ int swappy_init() {
  * @param page_id
  * @param tf enviroment pointer, if set, causes write page to call kern_yield
  */
+/**
+ * Claims the controller, a thread yields while someone else uses it
+ *  The controller is shared with disk mappings (ide_lock), so it may not
+ *  be held over a yield: the transfer itself busy waits.
+ */
+static void swappy_ide_lock(env_t * tf) {
+    if (tf) {
+        while (!ide_trylock()) kern_thread_yield(tf);
+    } else
+        ide_lock();
+}
+
 void swappy_write_page(page_info_t* pp, uint32_t page_id, env_t * tf) {
     dprintf("Swapping %p to swap index %d\n", pp, page_id);
+    swappy_ide_lock(tf);
     ide_start_write(swappy_index_to_sector(page_id), swappy_sectors_per_page);
     char * buffer = page2kva(pp);
     for (int w = 0; w < swappy_sectors_per_page; w++) {
-        if (tf) {
-            while (!ide_is_ready()) kern_thread_yield(tf);
-        } else
-            while (!ide_is_ready()) asm volatile("pause");
-
+        while (!ide_is_ready()) asm volatile("pause");
         ide_write_sector(buffer + (w * SECTSIZE));
     }
+    ide_unlock();
 }
 
 void swappy_read_page(page_info_t* pp, uint16_t page_id, env_t* tf) {
     dprintf("Unswapping index %d to page %p\n", page_id, pp);
     char * buffer = page2kva(pp);
+    swappy_ide_lock(tf);
     ide_start_read(swappy_index_to_sector(page_id), swappy_sectors_per_page);
     for (int i = 0; i < swappy_sectors_per_page; i++) {
-        if (tf) {
-            while (!ide_is_ready()) kern_thread_yield(tf);
-        } else
-            while (!ide_is_ready()) asm volatile("pause");
+        while (!ide_is_ready()) asm volatile("pause");
         ide_read_sector(buffer + (SECTSIZE * i));
     }
+    ide_unlock();
 }
 
 void swappy_decref(uint32_t index) {
@@ -204,6 +218,7 @@ int swappy_retrieve_page(uint16_t page_id, page_info_t *pp, env_t * tf) {
     /* We offset pageid by +1 outside swappy to ensure pte never becomes 0x0 */
     if (page_id == 0) {
         eprintf("Swappy received invalid page_id!\n");
+        swappy_lock_release(swappy_swap_lock);
         return swappy_error_invalidId;
     }
     /* So set page id back to internal level */
@@ -317,7 +332,7 @@ int swappy_swap_out(page_info_t * pp, env_t * tf) {
     return 0;
 }
 
-void swappy_queue_insert_swapout(page_info_t* pp) {
+int swappy_queue_insert_swapout(page_info_t* pp, int nowait) {
     static volatile int lock = 0;
 
     /* Aquire lock (only one queue'er should be writing) */
@@ -326,8 +341,16 @@ void swappy_queue_insert_swapout(page_info_t* pp) {
     dprintf("Swapping page %p (pa: %p; num: %d)\n", pp, page2pa(pp), PGNUM(page2pa(pp)));
 
     /* Check if there is space in the queue */
-    while (swappy_queue_items_out >= swappy_queue_size_swapout)
+    while (swappy_queue_items_out >= swappy_queue_size_swapout) {
+        if (nowait) {
+            swappy_lock_release(lock);
+            return -1;
+        }
         asm volatile("pause");
+    }
+
+    /* The queue holds a reference, so pp can not be reused while queued */
+    page_inc_ref(pp);
 
     /* get write position from read position + items left */
     swappy_lock_aquire(swappy_queue_poslock_out);
@@ -345,49 +368,97 @@ void swappy_queue_insert_swapout(page_info_t* pp) {
 
     /* Unlock */
     swappy_lock_release(lock);
+
+    return 0;
 }
 
-void swappy_thread_retrieve_page(env_t* tf, swappy_swapin_task task) {
-    static volatile int lock = 0;
+/* Serializes swap ins, a page must not be read twice */
+static volatile int swappy_swapin_lock = 0;
 
-    swappy_lock_aquire(lock);
+/**
+ * Points every other pte still holding the swap slot of opte at pp
+ *  Each of them takes a page reference and drops its slot reference, RW is
+ *  cleared so a write COW's the page. The slot is free afterwards.
+ * @param pp the swapped in page, mapped once already
+ * @param opte the swapped pte pp was read for
+ */
+static void swappy_share_swapped_in(page_info_t *pp, pte_t opte) {
+    uint32_t index = SWAPPY_PTE_TO_PAGEID(opte);
+    uint64_t it = 0;
+    pte_t *pte;
 
-    pte_t opte = *pgdir_walk(task.env->env_pgdir, task.fault_va, 0);
-    uint32_t pageId = SWAPPY_PTE_TO_PAGEID(opte);
+    swappy_lock_aquire(swappy_swap_lock);
+    while ((pte = reverse_swap_pte_lookup(opte, &it)) != 0) {
+        page_inc_ref(pp);
+        *pte = page2pa(pp) | (*pte & 0x1C) | PTE_BIT_PRESENT;
+        swappy_decref(index);
+    }
+    swappy_lock_release(swappy_swap_lock);
+}
 
-    /*  asserts  */
-    assert(task.env->env_status == ENV_WAITING_SWAP);
-    assert((opte & PTE_BIT_PRESENT) == 0);
+/**
+ * Reads the swapped page at va back in and maps it
+ *  The swapin lock must be held.
+ * @param tf thread to yield while waiting for memory, 0 to fail instead
+ * @return 0 on success (or when someone else swapped it in), -1 when out of memory
+ */
+static int swappy_load_page(env_t* tf, env_t *e, void *va) {
+    pte_t *pte = pgdir_walk(e->env_pgdir, va, WALK_WRITE);
+    pte_t opte = pte ? *pte : 0;
+    uint32_t pageId = PTE_GET_PHYS_ADDRESS(opte) >> 12; /* swappy_retrieve_page expects the +1 offset */
+    int shared;
+
+    if (!opte || (opte & PTE_BIT_PRESENT))
+        return 0;
 
     /* Allocate page for env */
-    dprintf("Allocating page for env %d...\n", task.env->env_id);
+    dprintf("Allocating page for env %d...\n", e->env_id);
     page_info_t *pp; //will be overwritten so no zero
     while( (pp = page_alloc(0)) == 0) {
-        if (tf)
-            kern_thread_yield(tf);
-        else
-            asm volatile("pause");
+        if (!tf)
+            return -1;
+        kern_thread_yield(tf);
     }
 
     /* Swap in */
-    if (pp) {
-        dprintf("Allocation successful, swapping in page...\n");
-        if (swappy_retrieve_page(pageId, pp, tf)) {
-            eprintf("Error while swapping page %p!\n", pp);
-            panic("Error while swapping!");
-        }
+    dprintf("Allocation successful, swapping in page...\n");
+    shared = pageId && swappy_desc_arr[pageId - 1].ref > 1;
+    if (swappy_retrieve_page(pageId, pp, tf)) {
+        eprintf("Error while swapping page %p!\n", pp);
+        panic("Error while swapping!");
+    }
+
+    /* A slot forked into other pte's: all of them get the page, COW shared */
+    if (shared)
+        opte &= ~(uint32_t)PTE_BIT_RW;
+
+    dprintf("Page swapin for env %d successful, inserting...\n", e->env_id);
+    if (page_insert(e->env_pgdir, pp, va, (opte & 0x1E) | PTE_BIT_PRESENT)) { //restore the permissions kept while swapped
+        page_free(pp);
+        return -1;
+    }
+
+    if (shared)
+        swappy_share_swapped_in(pp, opte);
+
+    return 0;
+}
 
-        /* Insert page and make env runnable */
-        dprintf("Page swapin for env %d successful, inserting and finishing request...\n", task.env->env_id);
-        page_insert(task.env->env_pgdir, pp, task.fault_va, 0);
-        task.env->env_status = ENV_RUNNABLE;
+void swappy_thread_retrieve_page(env_t* tf, swappy_swapin_task task) {
+    swappy_lock_aquire(swappy_swapin_lock);
 
+    /*  asserts  */
+    assert(task.env->env_status == ENV_WAITING_SWAP);
+
+    /* Insert page and make env runnable */
+    if (swappy_load_page(tf, task.env, task.fault_va) == 0) {
+        wake_up_env(&swappy_swapin_wq, task.env);
     } else {
-        eprintf("Failed to allocate new page for env %d!\n", task.env->env_id);
+        eprintf("Failed to swap in page for env %d!\n", task.env->env_id);
         murder_env(task.env, (uint32_t) task.fault_va);
     }
 
-    swappy_lock_release(lock);
+    swappy_lock_release(swappy_swapin_lock);
 }
 
 void swappy_queue_insert_swapin(swappy_swapin_task task) {
@@ -427,9 +498,31 @@ int swappy_swap_page_out(page_info_t * pp, int flags) {
     }
 
     /* Normal swapping (Give to a queue) */
-    swappy_queue_insert_swapout(pp);
+    return swappy_queue_insert_swapout(pp, flags & SWAPPY_SWAP_NOWAIT);
+}
 
-    return 0;
+void swappy_dup_swapped(pte_t pte) {
+    uint32_t index = SWAPPY_PTE_TO_PAGEID(pte);
+
+    assert(!(pte & PTE_BIT_PRESENT));
+    if (index >= descArrSize || !swappy_desc_arr[index].ref) {
+        eprintf("No reference to swap id %d found!\n", index);
+        return;
+    }
+
+    swappy_incref(index);
+}
+
+void swappy_drop_swapped(pte_t pte) {
+    uint32_t index = SWAPPY_PTE_TO_PAGEID(pte);
+
+    assert(!(pte & PTE_BIT_PRESENT));
+    if (index >= descArrSize || !swappy_desc_arr[index].ref) {
+        eprintf("No reference to swap id %d found!\n", index);
+        return;
+    }
+
+    swappy_decref(index);
 }
 
 int swappy_swap_page_in(uint32_t pageid, env_t * env, void * fault_va, int flags) {
@@ -438,10 +531,13 @@ int swappy_swap_page_in(uint32_t pageid, env_t * env, void * fault_va, int flags
     task.env = env;
     task.fault_va = fault_va;
 
-    /* Direct swapping if needed */
+    /* Direct swapping: synchronous, env keeps running (it is not queued) */
     if (flags & SWAPPY_SWAP_DIRECT) {
-        swappy_thread_retrieve_page((env_t*) 0, task);
-        return 0;
+        int r;
+        swappy_lock_aquire(swappy_swapin_lock);
+        r = swappy_load_page((env_t*) 0, env, fault_va);
+        swappy_lock_release(swappy_swapin_lock);
+        return r;
     }
 
     /* Normal swapping (Give to a queue) */
@@ -481,12 +577,13 @@ void swappy_service_swapout(env_t * tf) {
         /* Release position lock, we have our page data */
         swappy_lock_release(swappy_queue_poslock_out);
 
-        /* Swap out */
+        /* Swap out, unless the queue holds the last reference */
         if (pp) {
-            if (swappy_swap_out(pp, tf)) {
+            if (page_get_ref(pp) > 1 && swappy_swap_out(pp, tf)) {
                 eprintf("Error while swapping page %p!\n", pp);
                 panic("Error while swapping!");
             }
+            page_decref(pp);
         } else
             eprintf("0 pointer in queue!\n");
 
@@ -12,6 +12,9 @@
 
 #define SWAPPY_PTE_TO_PAGEID(PTE) ((PTE_GET_PHYS_ADDRESS(PTE) - 1) >> 12)
 
+/* Envs blocked on a queued swap in (ENV_WAITING_SWAP) */
+extern struct waitqueue swappy_swapin_wq;
+
 enum {
     swappy_error_noerror = 0,
     swappy_error_invaliddisk,
@@ -24,6 +27,7 @@ enum {
 /* Swappy_swap_flags */
 #define SWAPPY_SWAP_QUEUE 0
 #define SWAPPY_SWAP_DIRECT 1
+#define SWAPPY_SWAP_NOWAIT 2 /* Fail instead of waiting on a full queue */
 
 /**
  * Queues a page for swapping (or direct swapping if SWAPPY_SWAP_DIRECT is given)
@@ -33,12 +37,26 @@ enum {
  */
 int swappy_swap_page_out(page_info_t * pp, int swappy_swap_flag);
 /**
- * Queues a page for swapping (or direct swapping if SWAPPY_SWAP_DIRECT is given)
+ * Releases the swap slot referenced by a swapped out pte
+ *  Used when a swapped page is dropped without being swapped in.
+ * @param pte non present pte holding a swap id
+ */
+void swappy_drop_swapped(pte_t pte);
+/**
+ * Takes another reference to the swap slot of a swapped out pte
+ *  Used when a swapped pte is copied (fork, page table unsharing), a later
+ *  swap in through any copy gives all of them the page, COW shared.
+ * @param pte non present pte holding a swap id
+ */
+void swappy_dup_swapped(pte_t pte);
+/**
+ * Queues a page for swapping in (or swaps it in directly if SWAPPY_SWAP_DIRECT
+ *  is given, the env status is then left alone)
  * @param pageid
  * @param env
  * @param fault_va
  * @param swappy_swap_flag
- * @return 
+ * @return 0 on success, -1 if a direct swap in ran out of memory
  */
 int swappy_swap_page_in(uint32_t pageid, env_t * env, void * fault_va, int swappy_swap_flag);
 /**
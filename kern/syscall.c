@@ -10,9 +10,12 @@
 
 #include "env.h"
 #include "vma.h"
+#include "swappy.h"
 #include "pmap.h"
+#include "uaccess.h"
 #include "trap.h"
 #include "sched.h"
+#include "waitqueue.h"
 #include "syscall.h"
 #include "console.h"
 #include "../inc/memlayout.h"
@@ -28,15 +31,25 @@
  */
 static void sys_cputs(const char *s, size_t len)
 {
-    /* Check that the user has permission to read memory [s, s+len).
-     * Destroy the environment if not. */
-
-    if(user_mem_assert(curenv, (void*) s, len, PTE_BIT_USER | PTE_BIT_PRESENT) != 0){
+    char buf[256];
+    size_t n;
+
+    /* Print nothing unless all of [s, s+len) is readable, the faults taken
+     * here are the only validation. Destroy the environment if not. */
+    if (probe_user(s, len)) {
+        cprintf("[%08x] user_mem_check assertion failure for va %08x\n",
+                curenv->env_id, uaccess_fault_va());
+        env_destroy(curenv);
         return;
     }
 
-    /* Print the string supplied by the user. */
-    cprintf("%.*s", len, s);
+    /* Print the string supplied by the user through a kernel copy. */
+    for (; len; s += n, len -= n) {
+        n = MIN(len, sizeof(buf));
+        if (copy_from_user(buf, s, n))
+            return;
+        cprintf("%.*s", n, buf);
+    }
 }
 
 /*
@@ -94,7 +107,11 @@ static void *sys_vma_create(size_t size, int perm, int flags)
         return (void *)-1;
     }
 
-    return curenv->vma_list->vmas[index].va;
+    /* Remember our va, a merge may fold us into a neighbour */
+    void *va = curenv->vma_list->vmas[index].va;
+    vma_merge(curenv, &curenv->vma_list->vmas[index]);
+
+    return va;
 }
 
 /*
@@ -109,6 +126,154 @@ static int sys_vma_destroy(void *va, size_t size)
     return vma_unmap(curenv, va, size, 0);
 }
 
+/*
+ * Changes the access permissions of the pages in the range starting at
+ * virtual address 'va', 'size' bytes long. The range must be page aligned
+ * and fully mapped. A perm of 0 revokes all access.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_INVAL if the range is invalid, unmapped or perm is unknown.
+ *  -E_NO_MEM if the vma's could not be split.
+ */
+static int sys_vma_protect(void *va, size_t size, int perm)
+{
+    uint32_t start = (uint32_t) va;
+
+    if (start & 0xFFF || size == 0 || start + size < start)
+        return -E_INVAL;
+    if (start + size > UTOP)
+        return -E_INVAL;
+    if (perm & ~(VMA_PERM_READ | VMA_PERM_WRITE | VMA_PERM_EXEC))
+        return -E_INVAL;
+
+    return vma_protect(curenv, va, size, perm);
+}
+
+/*
+ * Gives the kernel a hint about how the range starting at virtual
+ * address 'va', 'size' bytes long will be accessed. The range must be
+ * page aligned and fully mapped.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_INVAL if the range is invalid, unmapped or the advice is unknown.
+ *  -E_NO_MEM if the vma's could not be split or populated.
+ */
+static int sys_vma_advise(void *va, size_t size, int advice)
+{
+    uint32_t start = (uint32_t) va;
+
+    if (start & 0xFFF || size == 0 || start + size < start)
+        return -E_INVAL;
+    if (start + size > UTOP)
+        return -E_INVAL;
+
+    return vma_advise(curenv, va, size, advice);
+}
+
+/*
+ * Creates a shared memory object of 'size' bytes. The object is not mapped,
+ * use sys_shm_map with the returned handle in every env that needs it.
+ * The handle belongs to the caller and is destroyed when the caller exits,
+ * existing mappings stay valid.
+ *
+ * Returns the handle (> 0) on success, < 0 on error.  Errors are:
+ *  -E_INVAL if size is 0 or too large.
+ *  -E_NO_MEM if no objects are left.
+ */
+static int sys_shm_create(size_t size)
+{
+    return shm_create(size, curenv->env_id);
+}
+
+/*
+ * Maps the whole shared object 'id' somewhere in the virtual address space.
+ * Writes through the mapping are seen by every env mapping the object,
+ * also across fork.
+ *
+ * Returns the address of the mapping on success,
+ * or -1 if the handle is invalid or the request could not be satisfied.
+ */
+static void *sys_shm_map(int id, int perm)
+{
+    shm_t *shm;
+    int index;
+
+    if (perm & ~(VMA_PERM_READ | VMA_PERM_WRITE | VMA_PERM_EXEC))
+        return (void *)-1;
+    if (!(shm = shm_lookup(id)))
+        return (void *)-1;
+
+    index = vma_new_range(curenv, shm->npages * PGSIZE, perm, VMA_SHARED);
+    if (index >= 0)
+        vma_set_shared(curenv, index, shm, 0);
+    shm_decref(shm);
+
+    if (index < 0)
+        return (void *)-1;
+    return curenv->vma_list->vmas[index].va;
+}
+
+/*
+ * Destroys the handle of shared object 'id'. Existing mappings stay valid,
+ * the memory is freed after the last one is unmapped.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_INVAL if the handle is invalid.
+ *  -E_BAD_ENV if the caller did not create the handle.
+ */
+static int sys_shm_destroy(int id)
+{
+    return shm_destroy(id, curenv->env_id);
+}
+
+/*
+ * Maps 'size' bytes of the disk data area starting at byte 'offset'
+ * somewhere in the virtual address space. Pages are read from disk on
+ * first touch. Writes go to disk on sys_vma_sync, unmap or exit. All
+ * mappings of the same range (same offset and size), in any env, share
+ * their pages.
+ *
+ * Returns the address of the mapping on success,
+ * or -1 if the range is invalid or the request could not be satisfied.
+ */
+static void *sys_vma_disk_map(uint32_t offset, size_t size, int perm)
+{
+    shm_t *shm;
+    int index;
+
+    if (offset & 0xFFF || size == 0)
+        return (void *)-1;
+    if (perm & ~(VMA_PERM_READ | VMA_PERM_WRITE | VMA_PERM_EXEC))
+        return (void *)-1;
+    if (!(shm = shm_get_disk(offset / PGSIZE, size)))
+        return (void *)-1;
+
+    index = vma_new_range(curenv, shm->npages * PGSIZE, perm, VMA_SHARED);
+    if (index >= 0)
+        vma_set_shared(curenv, index, shm, 0);
+    shm_decref(shm);
+
+    if (index < 0)
+        return (void *)-1;
+    return curenv->vma_list->vmas[index].va;
+}
+
+/*
+ * Writes the modified pages of disk mappings in the range starting at
+ * virtual address 'va', 'size' bytes long back to disk.
+ *
+ * Returns 0 on success, -E_INVAL if the range is invalid or unmapped.
+ */
+static int sys_vma_sync(void *va, size_t size)
+{
+    uint32_t start = (uint32_t) va;
+
+    if (size == 0 || start + size < start || start + size > UTOP)
+        return -E_INVAL;
+
+    return vma_sync(curenv, va, size);
+}
+
 /*
  * Deschedule current environment and pick a different one to run.
  */
@@ -116,6 +281,11 @@ static void sys_yield(void)
 {
     /* Set ESP to KSTACKTOP for current CPU */
     volatile uint32_t kstacktop_i = KSTACKTOP - cpunum() * (KSTKSIZE + KSTKGAP);
+
+    /* Give up the rest of the slice, an EDF env the rest of this period */
+    curenv->remain_cpu_time = 0;
+    curenv->env_rt.budget = 0;
+
     asm volatile (
     "mov %0, %%esp\n"
     :: "a" (kstacktop_i));
@@ -123,197 +293,181 @@ static void sys_yield(void)
     sched_yield();
 }
 
+/*
+ * Blocks the caller until env 'envid' has exited. Returns at once if it
+ * already has (or never existed).
+ *
+ * Returns 0.
+ */
 static int sys_wait(envid_t envid)
 {
-    /* LAB 5: Your code here */
-    if(ENVX(envid) > NENV) {
-        dprintf("Invalid envid %p\n", envid);
-        return -1;
-    }
-    
-    dprintf("%p shall now wait for %p\n", curenv->env_id, envid);
+    struct waitqueue *wq = env_exit_waitqueue(envid);
+    env_t *e = &envs[ENVX(envid)];
 
-    env_t *env = &envs[envid];
-    env_t *cur = (env_t *)curenv; /* IDE's macro unfolding is broken */
+    dprintf("%p shall now wait for %p\n", curenv->env_id, envid);
 
-    if(!env || !cur) {
-        dprintf("%p cannot wait for %p, %p does not exist!\n", curenv->env_id, envid, envid);
-        return -1;
+    /* env_free marks the slot free before it wakes the queue, checking
+     * under the queue lock means we are either woken or do not wait */
+    spin_lock(&wq->lock);
+    if (e->env_status != ENV_FREE && e->env_id == envid && e != curenv) {
+        /* Once queued we may run elsewhere before trap returns */
+        curenv->env_tf.tf_regs.reg_eax = 0;
+        wait_event_locked(wq, curenv, ENV_WAITING);
     }
-    
-    cur->env_status = ENV_WAITING;
-    cur->waiting_for = envid;
-    
+    spin_unlock(&wq->lock);
+
     return 0;
 }
 
 /**
- * Fork a pagetable
- *  Allocate new pgtable for child
- *  Copy pgtable
- *  Make entries COW when needed
- * @param ppdir
- * @param cpdir
- * @param i
- * @return 
+ * Copies the mappings of [start, end) within one 4MB region to the child
+ *  A region the child has no table for yet is shared as a whole: both
+ *  directories point at the parent's table, write protected at the PDE,
+ *  and the table gains a reference. The first fault or mapping change
+ *  copies it (pgtable_unshare), so fork itself only touches PDEs.
+ *  Otherwise (the child's vma array lives in this region) the entries are
+ *  copied: present pages gain a reference, writable ones lose RW in the
+ *  parent and the child (COW) unless cow is 0. Swapped entries stay
+ *  swapped in both and take another swap slot reference.
+ * @param ppdir parent pgdir
+ * @param cpdir child pgdir
+ * @param start
+ * @param end must not pass the end of the region of start
+ * @param cow
+ * @return 0 on success, -1 if no child page table could be allocated
  */
-int fork_pgtable_cow(env_t *pe, pde_t* ppdir, pde_t* cpdir, uint32_t i){
-    //Define COW'able pte enrty
-    uint32_t pte_small_check = PTE_BIT_PRESENT | PTE_BIT_USER;
-    
+static int fork_range_cow(pde_t *ppdir, pde_t *cpdir, uint32_t start, uint32_t end, int cow) {
+    uint32_t i = PDX(start);
+    pte_t *ppt, *cpt;
+
     if (!(ppdir[i] & PDE_BIT_PRESENT))
         return 0;
 
-    /* Set table pointers */
-    pte_t * ppt = KADDR(PDE_GET_ADDRESS(ppdir[i]));
-    pte_t * cpt = KADDR(PDE_GET_ADDRESS(cpdir[i]));
-  
-    for(uint32_t j = 0; j< 1024; j++) {
-        /* If entry is comform COW, make it COW and Always copy it */
-        if ((ppt[j] & pte_small_check) == pte_small_check)
-            if (vma_lookup(pe, (void*) ((i*PGSIZE*1024) + (j*PGSIZE)), 0)->perm | VMA_PERM_WRITE)
-                ppt[j] &= ~(uint32_t)PTE_BIT_RW;
-            
-        
-        cpt[j] = ppt[j];
-        
-        /* Inc ref on user pages*/
-//        if (ppt[j]) dprintf("(%p) %p\n", PTE_GET_PHYS_ADDRESS(ppt[j]), ppt[j]);
-        if (ppt[j] & PTE_BIT_PRESENT) //if present
-            if (ppt[j] & PTE_BIT_USER) //And user accessable
-                if (PGNUM(PTE_GET_PHYS_ADDRESS(ppt[j])) < npages) //and refers to existing physical page
-                    page_inc_ref(pa2page(PTE_GET_PHYS_ADDRESS(ppt[j]))); //Increase reference
-    } //end for
-    
-    return 0;
-}
+    /* Huge pages and tables are shared as a whole, the first vma in it handles it */
+    if (!cpdir[i]) {
+        if (!(ppdir[i] & PDE_BIT_HUGE) || cow)
+            ppdir[i] &= ~(uint32_t)PDE_BIT_RW;
+        cpdir[i] = ppdir[i];
+        page_inc_ref(pa2page(PDE_GET_ADDRESS(ppdir[i])));
+        return 0;
+    }
+    if (cpdir[i] == ppdir[i] || (ppdir[i] & PDE_BIT_HUGE))
+        return 0;
 
-int fork_allocate_pgtables(pde_t* cpdir, pde_t* ppdir){
-    for(uint16_t i = 0; i<1024; i++) {
-        /* Only for user accessable pages under utop */
-        if ((uint32_t)PGADDR(i,0,0) >= UTOP)
+    /* The child may have a table here already (vma array, earlier vma) */
+    if (!(cpt = pgdir_walk(cpdir, (void*) start, CREATE_NORMAL)))
+        return -1;
+    cpt -= PTX(start);
+    ppt = KADDR(PDE_GET_ADDRESS(ppdir[i]));
+
+    for (uint32_t j = PTX(start); j < PTX(end - 1) + 1; j++) {
+        if (!ppt[j])
             continue;
-        
-        /* Allocate page table */
-        if (ppdir[i] & PDE_BIT_PRESENT && !(ppdir[i] & PDE_BIT_HUGE) && ppdir[i] & PDE_BIT_USER) {
-            /* Allocate new page for childs pgtable */
-            page_info_t * pp = page_alloc(0); // we copy every entry, so no zero alloc
-            if (!pp) {
-                dprintf("Allocation failed!\n");
-                return -1;
-            }
-            page_inc_ref(pp);
-            
-            /* 
-            * Insert new page (table) into child pgdir 
-            * Keep parent permissions
-            */
-            cpdir[i] = page2pa(pp) | (ppdir[i] & 0x1F);
-        }
+
+        if (ppt[j] & PTE_BIT_PRESENT) {
+            if (cow)
+                ppt[j] &= ~(uint32_t)PTE_BIT_RW;
+            if (PGNUM(PTE_GET_PHYS_ADDRESS(ppt[j])) < npages)
+                page_inc_ref(pa2page(PTE_GET_PHYS_ADDRESS(ppt[j])));
+        } else if (PTE_GET_PHYS_ADDRESS(ppt[j]))
+            swappy_dup_swapped(ppt[j]);
+
+        cpt[j] = ppt[j];
     }
+
     return 0;
 }
 
-void fork_reverse_pgtable_alloc(pde_t* cpdir){
-    dprintf("Reversing allocation of page tables.\n");
-    for(uint32_t i = 0; i<1024; i++) {
-        if (cpdir[i] & PDE_BIT_PRESENT && !(cpdir[i] & PDE_BIT_HUGE)  && cpdir[i] & PDE_BIT_USER) {
-            page_info_t * pp = pa2page(PDE_GET_ADDRESS(cpdir[i]));
-            if (pp->pp_ref == 1)
-                page_decref(pp);
+/**
+ * Copies the address space of penv to cenv, vma by vma
+ *  The COW decision is made once per vma: writable private memory is
+ *  write protected, shared memory stays writable in both.
+ *  On failure the child keeps what was copied so far, env_free releases it.
+ * @param penv
+ * @param cenv
+ * @return 0 on success, -1 on out of memory
+ */
+static int fork_address_space(env_t *penv, env_t *cenv) {
+    vma_arr_t *vmar = penv->vma_list;
+    uint8_t i = vmar->lowest_va_vma;
+
+    for (; i != VMA_INVALID_INDEX; i = vmar->vmas[i].n_adj) {
+        vma_t *vma = &vmar->vmas[i];
+        uint32_t va = (uint32_t) vma->va;
+        uint32_t end = va + vma->len;
+        int cow = (vma->perm & VMA_PERM_WRITE) && vma->type != VMA_SHARED;
+
+        /* One page table (4MB region) at a time */
+        while (va < end) {
+            uint32_t next = MIN(ROUNDDOWN(va, PTSIZE) + PTSIZE, end);
+            if (fork_range_cow(penv->env_pgdir, cenv->env_pgdir, va, next, cow))
+                return -1;
+            va = next;
         }
     }
-}
 
-int fork_pgdir_copy_and_cow(env_t * penv ,env_t* cenv){
-    /* Setup permission check register */
-    uint32_t pde_huge_check = PDE_BIT_HUGE | PDE_BIT_PRESENT | PDE_BIT_USER;
-    
-    /* page dir pointers */
-    pde_t * ppdir = penv->env_pgdir;
-    pde_t * cpdir = cenv->env_pgdir;
-    
-    /* Duplicate */
-    memcpy(cpdir, ppdir, PGSIZE);
-    
-    /* Allocate first, any error can be reverted! */
-    if (fork_allocate_pgtables(cpdir,ppdir)) {
-        dprintf("Out of Memory!\n");
-        fork_reverse_pgtable_alloc(cpdir);
-        return 0;
-    }
-    
-    /* 
-     * - Duplicate pgdir
-     * \- edit pgdir entry to COW when pde_huge_check comfirms
-     */
-    for(uint32_t i = 0; i<1024; i++) {   
-        /* Look only at present entries */
-        if (!(ppdir[i] & PDE_BIT_PRESENT))
-            continue;
-        
-        /* Pages under utop */
-        if ((uint32_t)PGADDR(i,0,0) >= UTOP)
-            continue;
-        
-        /* If page is huge and must be cow'ed: remove w bit*/
-        if ((ppdir[i] & pde_huge_check) == pde_huge_check)
-            if (vma_lookup(penv, (void*)(i*PGSIZE*1024), 0)->perm & VMA_PERM_WRITE)
-                /* Remove write bit */
-                cpdir[i] = (ppdir[i] &= ~(uint32_t)PDE_BIT_RW);
-
-        /* Increase page reference of the huge page */
-        if (ppdir[i] & PDE_BIT_HUGE)
-            if (ppdir[i] & PDE_BIT_USER)
-                page_inc_ref(pa2page(PDE_GET_ADDRESS(ppdir[i])));
-
-        /* If it is not huge, copy pgtable */
-        if (!(ppdir[i] & PDE_BIT_HUGE))
-            if (fork_pgtable_cow(penv, ppdir, cpdir, i))
-                return -1;
-    }
-    
     return 0;
 }
 
-
-static int sys_fork(void)
+/**
+ * Creates a COW copy of penv, the copy returns 0 from its syscall
+ *  The copy is left ENV_NOT_RUNNABLE.
+ * @param penv env to copy
+ * @param parent_id parent of the copy
+ * @param store the copy
+ * @return 0 on success, < 0 on error
+ */
+static int fork_env(env_t *penv, envid_t parent_id, env_t **store)
 {
-    /* fork() that follows COW semantics */
-    /* LAB 5: Your code here */
     env_t *newenv;
-    
+    int r;
+
     /* Allocate env  & duplicate shared info */
-    if (env_alloc(&newenv, curenv->env_id, ENV_TYPE_USER)) {
+    if ((r = env_alloc(&newenv, parent_id, ENV_TYPE_USER)) < 0) {
         cprintf("Failed to fork new child process!\n");
-        return -1;
+        return r;
     }
     
     //registers
-    newenv->env_tf = curenv->env_tf;
+    newenv->env_tf = penv->env_tf;
     
     //Etc
-//    newenv->env_status = ENV_RUNNABLE; Not yet!!!
-    newenv->env_type = curenv->env_type;
+    newenv->env_type = penv->env_type;
+    newenv->stack_limit = penv->stack_limit;
+    sched_set_nice(newenv, penv->env_nice);
+    newenv->env_affinity = penv->env_affinity;
     
     /* Copy pgdir, changing permissions to COW where applicable 
      * for both the parent and the child
      */
-    if (fork_pgdir_copy_and_cow(curenv, newenv)) {
+    if (fork_address_space(penv, newenv)) {
         dprintf("forking pgdir failed!\n");
         env_free(newenv);
-        return -1;
+        return -E_NO_MEM;
     }
     dprintf("Forking pgdir success!\n");
     
     /* Child now inherits the COW thingies */
-    memcpy(newenv->vma_list, curenv->vma_list, sizeof(vma_arr_t));
+    vma_array_copy(newenv, penv);
     
     /* make eax (return value) 0, such that it knows it is new */
     newenv->env_tf.tf_regs.reg_eax = 0;
     
     /* Change uvpt to reflect the child page table in the child pgdir */
     newenv->env_pgdir[PDX(UVPT)] = PADDR(newenv->env_pgdir) | PTE_P | PTE_U;
+
+    *store = newenv;
+    return 0;
+}
+
+static int sys_fork(void)
+{
+    /* fork() that follows COW semantics */
+    /* LAB 5: Your code here */
+    env_t *newenv;
+
+    if (fork_env(curenv, curenv->env_id, &newenv))
+        return -1;
     
     /* Flush tlb */
     tlbflush();
@@ -322,13 +476,312 @@ static int sys_fork(void)
 //    vma_dump_all(newenv);
     
     /* Child is now runnable! */
-    if (sync_bool_compare_and_swap(&newenv->env_status, ENV_NOT_RUNNABLE, ENV_RUNNABLE)==0)
-        panic("Set runnable failed!");
+    assert(newenv->env_status == ENV_NOT_RUNNABLE);
+    sched_wakeup(newenv);
     
     //Return the new env id so that the forker knows who he spawned
     return newenv->env_id;
 }
 
+/*
+ * Freezes a copy of the caller as a template (ENV_TEMPLATE). A template
+ * never runs, sys_template_spawn starts children from it which, like fork
+ * children, return 0 from this call. Destroy it with sys_env_destroy,
+ * otherwise it is destroyed when the caller is freed (exit or crash).
+ * The address space is shared with every child page table by page table,
+ * so a spawn only copies page directory entries and the vma array.
+ *
+ * Returns the envid of the template, 0 in its children, < 0 on error.
+ */
+static envid_t sys_template_create(void)
+{
+    env_t *e;
+    int r;
+
+    if ((r = fork_env(curenv, curenv->env_id, &e)) < 0)
+        return r;
+
+    /* We lost RW on the page tables we share with it */
+    tlbflush();
+
+    if (sync_bool_compare_and_swap(&e->env_status, ENV_NOT_RUNNABLE, ENV_TEMPLATE) == 0)
+        panic("Set template failed!");
+
+    return e->env_id;
+}
+
+/*
+ * Starts a child of the caller from the template 'id'.
+ *
+ * Returns the envid of the child on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if id is no template of the caller.
+ *  -E_NO_FREE_ENV, -E_NO_MEM if the child could not be created.
+ */
+static envid_t sys_template_spawn(envid_t id)
+{
+    env_t *t, *e;
+    int r;
+
+    if (envid2env(id, &t, 1) < 0 || t == curenv || t->env_status != ENV_TEMPLATE)
+        return -E_BAD_ENV;
+
+    if ((r = fork_env(t, curenv->env_id, &e)) < 0)
+        return r;
+
+    assert(e->env_status == ENV_NOT_RUNNABLE);
+    sched_wakeup(e);
+
+    return e->env_id;
+}
+
+/*
+ * Sets the nice value of env 'envid' (0 for the caller) or one of its
+ * children. Lower values get a larger share of the CPU, the weight grows
+ * ~1.25x per step. Children inherit the nice value on fork.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if envid is not the caller or one of its children.
+ *  -E_INVAL if nice is outside NICE_MIN .. NICE_MAX.
+ */
+static int sys_set_priority(envid_t envid, int nice)
+{
+    env_t *e;
+
+    if (envid2env(envid, &e, 1) < 0)
+        return -E_BAD_ENV;
+
+    return sched_set_nice(e, nice);
+}
+
+/*
+ * Reserves 'runtime' microseconds of CPU time every 'period' microseconds
+ * for the caller (earliest deadline first). While it has budget left in a period
+ * the caller runs before any env of the fair class; sys_yield ends its
+ * share of the current period. A runtime of 0 returns to the fair class.
+ * The reservation is not inherited on fork.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_INVAL if runtime > period.
+ *  -E_NO_CPU if no CPU has enough unreserved time left.
+ */
+static int sys_set_realtime(uint32_t runtime, uint32_t period)
+{
+    return sched_set_realtime(curenv, usec_to_tsc(runtime), usec_to_tsc(period));
+}
+
+/*
+ * Restricts env 'envid' (0 for the caller) or one of its children to the
+ * CPUs in 'mask', bit i standing for CPU i. Bits of CPUs that do not exist
+ * are ignored. Children inherit the mask on fork.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if envid is not the caller or one of its children.
+ *  -E_INVAL if mask contains no existing CPU, or leaves out the CPU the
+ *      env's real-time reservation was admitted to.
+ */
+static int sys_set_affinity(envid_t envid, uint32_t mask)
+{
+    env_t *e;
+
+    if (envid2env(envid, &e, 1) < 0)
+        return -E_BAD_ENV;
+
+    return sched_set_affinity(e, mask);
+}
+
+/*
+ * Copies the CPU accounting of env 'envid' (0 for the caller) or one of
+ * its children to 'ru'. Times are TSC cycles. Counters of an env running
+ * on another CPU meanwhile may be slightly behind.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if envid is not the caller or one of its children.
+ *  -E_FAULT if ru is not writable user memory.
+ */
+static int sys_getrusage(envid_t envid, struct rusage *ru)
+{
+    env_t *e;
+
+    if (envid2env(envid, &e, 1) < 0)
+        return -E_BAD_ENV;
+
+    /* Include this syscall so far */
+    if (e == curenv)
+        env_charge(e, 0);
+
+    return copy_to_user(ru, &e->env_rusage, sizeof(*ru));
+}
+
+/* Limits on what sys_spawn takes from the parent */
+#define SPAWN_NAME_LEN      32
+#define SPAWN_MAX_ARGS      32
+#define SPAWN_ARGS_SIZE     (PGSIZE / 2)
+
+/**
+ * Lays out the arguments at uargv in the initial stack page of a child
+ *  The strings fill the upper SPAWN_ARGS_SIZE bytes of the page, below them
+ *  argc, argv and the argv array itself, as lib/entry.S expects them.
+ * @param kva kernel address of the page, mapped at USTACKTOP - PGSIZE
+ * @param uargv NULL terminated user array, may be NULL
+ * @return offset of the initial esp in the page, < 0 on error
+ */
+static int spawn_stack_args(char *kva, const char **uargv)
+{
+    uint32_t base = USTACKTOP - PGSIZE;
+    uint32_t argp[SPAWN_MAX_ARGS];
+    uint32_t pos = PGSIZE - SPAWN_ARGS_SIZE;
+    uint32_t *vec;
+    const char *uarg;
+    int argc, len;
+
+    for (argc = 0; uargv; argc++) {
+        if (copy_from_user(&uarg, &uargv[argc], sizeof(uarg)))
+            return -E_FAULT;
+        if (!uarg)
+            break;
+        if (argc == SPAWN_MAX_ARGS)
+            return -E_INVAL;
+
+        if ((len = strncpy_from_user(kva + pos, uarg, PGSIZE - pos)) < 0)
+            return len;
+        if (len == PGSIZE - pos)
+            return -E_INVAL;
+
+        argp[argc] = base + pos;
+        pos += len + 1;
+    }
+
+    /* argc, argv, argv[0..argc-1], NULL */
+    vec = (uint32_t *) (kva + PGSIZE - SPAWN_ARGS_SIZE) - (argc + 3);
+    vec[0] = argc;
+    vec[1] = base + (uint32_t) &vec[2] - (uint32_t) kva;
+    memcpy(&vec[2], argp, argc * sizeof(argp[0]));
+    vec[2 + argc] = 0;
+
+    return (char *) vec - kva;
+}
+
+/**
+ * Copies the binary name and arguments of sys_spawn and sys_exec in
+ * @param name user string
+ * @param argv user argument vector
+ * @param kname buffer of SPAWN_NAME_LEN bytes
+ * @param stack filled in with the initial stack page
+ * @return offset of the initial esp in the stack page, < 0 on error
+ */
+static int spawn_prepare(const char *name, const char **argv, char *kname, page_info_t **stack)
+{
+    int r;
+
+    if ((r = strncpy_from_user(kname, name, SPAWN_NAME_LEN)) < 0)
+        return r;
+    if (r == SPAWN_NAME_LEN)
+        return -E_INVAL;
+
+    if (!(*stack = page_alloc(ALLOC_ZERO)))
+        return -E_NO_MEM;
+    if ((r = spawn_stack_args(page2kva(*stack), argv)) < 0)
+        page_free(*stack);
+
+    return r;
+}
+
+/*
+ * Creates a new env running the embedded binary 'name' (a KERN_BINFILES
+ * entry without directory, e.g. "hello") with the NULL terminated argument
+ * vector 'argv', which may be NULL. Unlike fork, the parent's address space
+ * is not touched at all.
+ *
+ * Returns the envid of the child on success, < 0 on error.  Errors are:
+ *  -E_FAULT if name, argv or one of the arguments is not readable.
+ *  -E_INVAL if there is no such binary or the arguments do not fit.
+ *  -E_NO_FREE_ENV, -E_NO_MEM if the env could not be created.
+ */
+static envid_t sys_spawn(const char *name, const char **argv)
+{
+    char kname[SPAWN_NAME_LEN];
+    page_info_t *stack;
+    env_t *e;
+    int r, esp;
+
+    /* Arguments first, nothing to undo when they are bad */
+    if ((esp = spawn_prepare(name, argv, kname, &stack)) < 0)
+        return esp;
+
+    if ((r = env_spawn(&e, curenv->env_id, kname)) < 0) {
+        page_free(stack);
+        return r;
+    }
+
+    /* The stack vma grows down from here */
+    if (page_insert(e->env_pgdir, stack, (void *) (USTACKTOP - PGSIZE),
+            PTE_BIT_PRESENT | PTE_BIT_RW | PTE_BIT_USER)) {
+        page_free(stack);
+        env_free(e);
+        return -E_NO_MEM;
+    }
+    e->env_tf.tf_esp = USTACKTOP - PGSIZE + esp;
+
+    assert(e->env_status == ENV_NOT_RUNNABLE);
+    sched_wakeup(e);
+
+    return e->env_id;
+}
+
+/*
+ * Replaces the image of the caller by the embedded binary 'name' with the
+ * arguments 'argv', see sys_spawn. The envid stays the same. Called from a
+ * vfork child, the parent resumes.
+ *
+ * Does not return on success, returns < 0 on error.  Errors are those of
+ * sys_spawn, the caller is unchanged then.
+ */
+static int sys_exec(const char *name, const char **argv)
+{
+    char kname[SPAWN_NAME_LEN];
+    page_info_t *stack;
+    int r, esp;
+
+    if ((esp = spawn_prepare(name, argv, kname, &stack)) < 0)
+        return esp;
+
+    if ((r = env_exec(curenv, kname, stack, USTACKTOP - PGSIZE + esp)) < 0) {
+        page_free(stack);
+        return r;
+    }
+
+    return 0;
+}
+
+/*
+ * Creates a child which runs on the address space of the caller instead of
+ * a copy, the caller is suspended until the child calls sys_exec or exits.
+ * Everything the child writes is seen by the parent, it must not return
+ * from the function which called sys_vfork.
+ *
+ * Returns the envid of the child to the parent and 0 to the child,
+ * < 0 on error.
+ */
+static envid_t sys_vfork(void)
+{
+    env_t *e;
+    int r;
+
+    if ((r = env_vfork(&e, curenv)) < 0)
+        return r;
+
+    e->env_tf.tf_regs.reg_eax = 0;
+    curenv->env_tf.tf_regs.reg_eax = e->env_id;
+
+    /* Suspend before the child can run, its exec or exit wakes us */
+    wait_event(env_exit_waitqueue(e->env_id), curenv, ENV_WAITING);
+
+    assert(e->env_status == ENV_NOT_RUNNABLE);
+    sched_wakeup(e);
+
+    return e->env_id;
+}
+
 /* Dispatches to the correct kernel function, passing the arguments. */
 int32_t syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3,
         uint32_t a4, uint32_t a5)
@@ -361,6 +814,38 @@ int32_t syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3,
             return sys_vma_destroy((void *)a1, a2);
         case SYS_fork:
             return sys_fork();
+        case SYS_vma_protect:
+            return sys_vma_protect((void *)a1, a2, a3);
+        case SYS_vma_advise:
+            return sys_vma_advise((void *)a1, a2, a3);
+        case SYS_shm_create:
+            return sys_shm_create(a1);
+        case SYS_shm_map:
+            return (uint32_t) sys_shm_map(a1, a2);
+        case SYS_shm_destroy:
+            return sys_shm_destroy(a1);
+        case SYS_vma_disk_map:
+            return (uint32_t) sys_vma_disk_map(a1, a2, a3);
+        case SYS_vma_sync:
+            return sys_vma_sync((void *)a1, a2);
+        case SYS_spawn:
+            return sys_spawn((const char *)a1, (const char **)a2);
+        case SYS_vfork:
+            return sys_vfork();
+        case SYS_exec:
+            return sys_exec((const char *)a1, (const char **)a2);
+        case SYS_template_create:
+            return sys_template_create();
+        case SYS_template_spawn:
+            return sys_template_spawn(a1);
+        case SYS_set_priority:
+            return sys_set_priority(a1, a2);
+        case SYS_set_realtime:
+            return sys_set_realtime(a1, a2);
+        case SYS_set_affinity:
+            return sys_set_affinity(a1, a2);
+        case SYS_getrusage:
+            return sys_getrusage(a1, (struct rusage *)a2);
         default:
             return -E_NO_SYS;
     }
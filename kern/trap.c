@@ -23,6 +23,8 @@
 #include "spinlock.h"
 #include "kdebug.h"
 #include "swappy.h"
+#include "waitqueue.h"
+#include "uaccess.h"
 
 static struct taskstate ts;
 
@@ -119,6 +121,7 @@ void trap_init(void)
     SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, (uint32_t)&trap_irq_ide, 0);
     SETGATE(idt[IRQ_OFFSET + 15], 0, GD_KT, (uint32_t)&trap_irq_15, 0);
     SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, (uint32_t)&trap_irq_err, 0);
+    SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, (uint32_t)&trap_irq_resched, 0);
 
     /* Per-CPU setup */
     trap_init_percpu();
@@ -240,8 +243,10 @@ static void trap_dispatch(struct trapframe *tf)
             //Do systemcall
             ret = syscall(callnum, a1,a2,a3,a4,a5);
 
-            //Set the user env. eax
-            tf->tf_regs.reg_eax = ret;
+            //Set the user env. eax, unless it blocked and may run elsewhere
+            //already (blocking syscalls set it themselves)
+            if (sched_curenv_ours())
+                tf->tf_regs.reg_eax = ret;
             break;
         case T_PGFLT:
             page_fault_handler(tf);
@@ -269,6 +274,11 @@ static void trap_dispatch(struct trapframe *tf)
             lapic_eoi();
             sched_yield();
             break;
+        /* Another CPU queued work for us (or for stealing) */
+        case IRQ_OFFSET + IRQ_RESCHED:
+            lapic_eoi();
+            sched_yield();
+            break;
         default:
             /* Unexpected trap: The user process or the kernel has a bug. */
             print_trapframe(tf);
@@ -281,12 +291,19 @@ static void trap_dispatch(struct trapframe *tf)
     }
 }
 
+static void trap_uaccess_fault(struct trapframe *tf);
+
 void trap(struct trapframe *tf)
 {
     /* The environment may have set DF and some versions of GCC rely on DF being
      * clear. */
     asm volatile("cld" ::: "cc");
 
+    /* A syscall touching user memory, before anything else uses tf */
+    if (tf->tf_cs == GD_KT && tf->tf_trapno == T_PGFLT &&
+            curenv && curenv->env_type == ENV_TYPE_USER)
+        trap_uaccess_fault(tf);
+
     /* If this is an intra-ring0 trap, we need to save the esp manually */
     if(tf->tf_cs == 0x08) {
         tf->tf_esp = (uint32_t)tf;
@@ -304,12 +321,20 @@ void trap(struct trapframe *tf)
      * in the interrupt path. */
     assert(!(read_eflags() & FL_IF));
 
+    /* Woken from sched_halt, by the timer or a reschedule IPI */
+    if (thiscpu->cpu_status == CPU_HALTED)
+        xchg(&thiscpu->cpu_status, CPU_STARTED);
+
     if (TRAPPRINT) cprintf("Incoming TRAP frame at %p\n", tf);
 //    dprintf("Trapframe for cpu %d, trapno: %d\n", thiscpu->cpu_id, tf->tf_trapno);
 
     if ((tf->tf_cs & 3) == 3 || (tf->tf_cs == GD_KT && curenv)) {
         assert(curenv);
 
+        /* User time ends, kernel time starts */
+        if ((tf->tf_cs & 3) == 3)
+            env_charge(curenv, 1);
+
         /* Garbage collect if current environment is a zombie. */
         if (curenv->env_status == ENV_DYING) {
             env_free(curenv);
@@ -337,7 +362,7 @@ void trap(struct trapframe *tf)
 
     /* If we made it to this point, then no other environment was scheduled, so
      * we should return to the current environment if doing so makes sense. */
-    if (curenv && curenv->env_status == ENV_RUNNING)
+    if (sched_curenv_ours())
         env_run(curenv);
     else
         sched_yield();
@@ -357,32 +382,61 @@ void murder_env(env_t *env, uint32_t fault_va) {
     env_destroy(env);
 }
 
-int trap_handle_cow(uint32_t fault_va){
-
-//    vma_t* hit, pte_t** pte, pte_t pte_original, page_info_t* new_page;
-    vma_t * hit = vma_lookup(curenv, (void*) fault_va, 0);
+/* Per cpu page fault statistics, indexed by PAGEFAULT_TYPE_* */
+static struct {
+    uint64_t count;
+    uint64_t cycles;
+} pagefault_stats[NCPU][PAGEFAULT_TYPE_COUNT];
+
+static const char *pagefault_names[PAGEFAULT_TYPE_COUNT] = {
+    [PAGEFAULT_TYPE_NONE] = "none",
+    [PAGEFAULT_TYPE_KERNEL] = "kernel",
+    [PAGEFAULT_TYPE_OUTSIDE_USER_RANGE] = "outside user range",
+    [PAGEFAULT_TYPE_NO_VMA] = "no vma",
+    [PAGEFAULT_TYPE_UNUSED_VMA] = "unused vma",
+    [PAGEFAULT_TYPE_INVALID_PERMISSION] = "invalid permission",
+    [PAGEFAULT_TYPE_COW] = "cow",
+    [PAGEFAULT_TYPE_FILEBACKED] = "filebacked",
+    [PAGEFAULT_TYPE_NO_PTE] = "no pte",
+    [PAGEFAULT_TYPE_SWAP] = "swap",
+    [PAGEFAULT_TYPE_NO_MEMORY] = "no memory",
+};
 
-    //store original pte
-    pte_t pte_original = *pgdir_walk(curenv->env_pgdir, (void*)fault_va, 0);
+const char *pagefault_name(int type) {
+    return pagefault_names[type];
+}
 
-    if (!hit || ! pte_original) {
-        cprintf("[COW] Invalid pte (%p) or vma (", pte_original);
-        if (hit)
-            vma_dump(hit);
-        cprintf(")!\n");
-        return -1;
+void pagefault_stats_dump() {
+    cprintf("%-20s %10s %12s\n", "type", "faults", "cycles/fault");
+    for (int t = 0; t < PAGEFAULT_TYPE_COUNT; t++) {
+        uint64_t count = 0, cycles = 0;
+        for (int c = 0; c < NCPU; c++) {
+            count += pagefault_stats[c][t].count;
+            cycles += pagefault_stats[c][t].cycles;
+        }
+        if (count)
+            cprintf("%-20s %10u %12u\n", pagefault_names[t],
+                    (uint32_t) count, (uint32_t) (cycles / count));
     }
+}
+
+int trap_handle_cow(pagefault_t *pf){
+    uint32_t fault_va = pf->va;
+    vma_t * hit = pf->vma;
+    pte_t pte_original = *pf->pte;
 
-    if ((hit->perm & VMA_PERM_WRITE) && !(pte_original & PDE_BIT_HUGE)) {
+    if (!(pte_original & PDE_BIT_HUGE)) {
         dprintf("va %p original_pte %p (phy_addr: %p)\n", fault_va, pte_original, PTE_GET_PHYS_ADDRESS(pte_original));
 
         /* If page is only referenced once, it is no longer shared! */
         /* Get page */
         page_info_t *cow_page = pa2page(PTE_GET_PHYS_ADDRESS(pte_original));
 
-        if (page_get_ref(cow_page) <= 1) {
+        /* Shared memory is written in place, it only lost RW to fork/protect */
+        if (page_get_ref(cow_page) <= 1 || hit->type == VMA_SHARED) {
             dprintf("Page referenced only once. Assuming not shared.\n");
-            *pgdir_walk(curenv->env_pgdir, (void*)fault_va, 0) |= PTE_BIT_RW;
+            *pf->pte |= PTE_BIT_RW;
+            tlb_invalidate(curenv->env_pgdir, (void*)fault_va);
             return 0;
         }
 
@@ -394,6 +448,15 @@ int trap_handle_cow(uint32_t fault_va){
             cprintf("[COW] Page allocation failed!\n");
             return -1;
         }
+
+        /* Copy before the old page loses our reference */
+        /* The zero page needs no copy, new_page is zeroed already */
+        if (cow_page != vma_zero_page) {
+            void *src = (void*) page2kva(cow_page);
+            void *dst = (void*) page2kva(new_page);
+            memcpy(dst, src, PGSIZE);
+        }
+
         /* Insert page with original permissions + write */
         /* Insert handles pg_decref */
         /* Insert handles pg_ref++ */
@@ -401,303 +464,300 @@ int trap_handle_cow(uint32_t fault_va){
                 (pte_original & 0x1F) | PTE_BIT_RW))
         {
             cprintf("[COW] Page insertion failed!\n");
-            page_decref(new_page);
+            page_free(new_page);
             return -1;
         }
 
-        void *src = (void*) page2kva(cow_page);
-        void *dst = (void*) page2kva(new_page);
-        memcpy(dst, src, PGSIZE);
-
-
-        /* Make a final assertion, cow should only trigger on writes */
-        assert(hit->perm & PTE_BIT_RW);
-        assert(hit->perm & VMA_PERM_WRITE);
-
-        
         dprintf("va %p now maps to %p\n", fault_va, page2pa(new_page));
 
         return 0;
-    }else
-        if (hit->perm & VMA_PERM_WRITE) {
-            /* Hit on huge page */
-            dprintf("va %p original_pte %p (phy_addr: %p)\n", hit->va, pte_original, PTE_GET_PHYS_ADDRESS(pte_original));
-
-            /* Make some assertions */
-            assert(pte_original & PDE_BIT_HUGE); //Should always be true due to if statement
-            assert(hit->perm & VMA_PERM_WRITE);
-            assert(pte_original * PDE_BIT_RW);
-
-            /* Check if page is still shared */
-            page_info_t *cow_page = pa2page(PDE_GET_ADDRESS(pte_original));
-
-            if (page_get_ref(cow_page) <= 1) {
-                cprintf("[COW] Page referenced only once. Assuming not shared.\n");
-                *pgdir_walk(curenv->env_pgdir, (void*)fault_va, 0) |= PTE_BIT_RW;
-                return 0;
-            }
-
-            /* Now create 4M entry and handle cow */
-            page_info_t *new_page = page_alloc(ALLOC_HUGE);
-
-            if (!new_page) {
-                cprintf("[COW] [HUGE] Page allocation failed!\n");
-                return -1;
-            }
-
-
-            if (page_insert(curenv->env_pgdir, new_page, (void*) page2pa(new_page),
-                    PDE_BIT_PRESENT | PDE_BIT_RW | PDE_BIT_HUGE | PDE_BIT_USER
-                    ))
-            {
-                cprintf("[COW] [HUGE] Page insertion failed!\n");
-                page_decref(new_page);
-                return -1;
-            }
-
-            /* Copy original data */
-            void *src = (void*) page2kva(cow_page);
-            void *dst = (void*) page2kva(new_page);
-
-            memcpy(dst, src, PGSIZE*1024);
+    }
 
-            return 0;
-        }
+    /* Hit on huge page */
+    dprintf("va %p original_pte %p (phy_addr: %p)\n", hit->va, pte_original, PDE_GET_ADDRESS(pte_original));
 
-    return -1;
-}
+    /* Check if page is still shared */
+    page_info_t *cow_page = pa2page(PDE_GET_ADDRESS(pte_original));
 
-int trap_handle_backed_memory(uint32_t fault_va){
-    vma_t * vma = vma_lookup(curenv, (void*)fault_va, 0);
-    if (vma->backed_addr && vma->len) {
-        /* Our vma is backed! */
-        dprintf("Backing memory address %p\n", fault_va);
+    if (page_get_ref(cow_page) <= 1) {
+        cprintf("[COW] Page referenced only once. Assuming not shared.\n");
+        *pf->pte |= PTE_BIT_RW;
+        tlb_invalidate(curenv->env_pgdir, (void*)fault_va);
+        return 0;
+    }
 
-        page_info_t * page = page_alloc(ALLOC_ZERO);
-        if (!page) {
-            cprintf("Page allocation failed!\n");
-            return -1;
-        }
-//        page->pp_ref++;
+    /* Now create 4M entry and handle cow */
+    page_info_t *new_page = page_alloc(ALLOC_HUGE);
 
-        int perm = PTE_BIT_USER | PTE_BIT_PRESENT;
-        perm |= vma->perm & VMA_PERM_WRITE ? PTE_BIT_RW : 0;
+    if (!new_page) {
+        cprintf("[COW] [HUGE] Page allocation failed!\n");
+        return -1;
+    }
 
-        if (page_insert(curenv->env_pgdir, page, (void*)(fault_va & 0xFFFFF000), perm)) {
-            cprintf("[filebacked memory] Page insertion failed!\n");
-            page_decref(page);
-            return -1;
-        }
-        /* Set the inter vma offset of the file backing
-         * Take into account the intitial offset provided as non-allignment of the vma
-         * example:
-         *  vma_new(addr=0x0200020)
-         *  start addres will be 0x0200020
-         *  offset will be 0x20
-         *  as filebacking starts from requested vma addr
-         */
-        uint32_t page_va = fault_va & 0xFFFFF000;
-
-        /* Set copy parameters */
-        uint32_t src = (uint32_t)vma->backed_addr;
-        uint32_t dst = (uint32_t)page2kva(page);
-        uint32_t cpy_len = PGSIZE;
-
-        /* determine if dst_base is within page backed offset (null zone) */
-        /* page alligned -> [null zone | requested vma | null zone ] */
-        /* This is the case when it is the first page in the vma */
-        if ((page_va == (uint32_t)vma->va) && vma->backed_start_offset) {
-            /* We have a backed offset and this is the first page */
-            dst += vma->backed_start_offset;
-            assert(vma->backed_start_offset <= PGSIZE);
-            cpy_len -= vma->backed_start_offset;
-        }
+    /* Copy original data */
+    void *src = (void*) page2kva(cow_page);
+    void *dst = (void*) page2kva(new_page);
 
-        /* Check if we do not exceed our backed length */
-        uint32_t ivma_offset = fault_va - (uint32_t)vma->va;
-        if (ivma_offset > vma->backsize) {
-            uint32_t overflow = ivma_offset - vma->backsize;
-            if (overflow >= cpy_len)
-                return 0; //nothing to copy, we are in null region
+    memcpy(dst, src, PGSIZE*1024);
 
-            cpy_len -= overflow;
-        }
+    if (page_insert(curenv->env_pgdir, new_page, (void*) ROUNDDOWN(fault_va, PTSIZE),
+            PDE_BIT_PRESENT | PDE_BIT_RW | PDE_BIT_HUGE | PDE_BIT_USER
+            ))
+    {
+        cprintf("[COW] [HUGE] Page insertion failed!\n");
+        page_decref(new_page);
+        return -1;
+    }
 
-        /* Set correct src and dst offset in pages */
-        uint32_t pages_offset = fault_va - (uint32_t)vma->va;
-        pages_offset /= PGSIZE;
-        dst += pages_offset * PGSIZE;
-        src += pages_offset * PGSIZE;
+    return 0;
+}
 
-        /* Do memcpy */
-        memcpy((void*) dst, (void*) src, cpy_len);
+int trap_handle_backed_memory(pagefault_t *pf){
+    /* Our vma is backed! */
+    dprintf("Backing memory address %p\n", pf->va);
 
-        return 0;
+    /* Fills the page (and its neighbours) from the backing */
+    if (vma_fault_around(curenv, pf->vma, pf->va, pf->err & FEC_WR)) {
+        cprintf("[filebacked memory] Page allocation failed!\n");
+        return -1;
     }
 
-    return -1;
+    return 0;
 }
 
 /**
- * Determine the type of page fault
- * @param fault_va
- * @param is_kernel
- * @return
+ * Fills the fault context and classifies the fault
+ *  The page tables are walked once, handlers use pf->pde and pf->pte.
+ *  The hardware error code tells if the page was present (protection
+ *  violation) and if it was a write, so only the vma has to be consulted.
+ * @param pf
+ * @param tf
  */
-int determine_pagefault(uint32_t fault_va, bool is_kernel){
+void pagefault_init(pagefault_t *pf, struct trapframe *tf){
     env_t * e = curenv;
-    
-    /* Determine if this is the kernel */
-    if (is_kernel)
-        return PAGEFAULT_TYPE_KERNEL;
+
+    pf->va = rcr2();
+    pf->err = tf->tf_err;
+    pf->vma = 0;
+    pf->pde = 0;
+    pf->pte = 0;
+    pf->sync = (tf->tf_cs & 3) != 3 && e->env_type == ENV_TYPE_USER;
+
+    /* To allow on demand paging in kthreads, we must allow ring0 code accesses
+     * to addresses in the user address space. */
+    if (((tf->tf_cs & 3) != 3) && pf->va >= USTACKTOP) {
+        pf->type = PAGEFAULT_TYPE_KERNEL;
+        return;
+    }
 
     /* Determine if it is user accessable*/
-    if(!is_kernel && e->env_tf.tf_cs != GD_KT && (fault_va < USTABDATA || fault_va >= UTOP))
-        return PAGEFAULT_TYPE_OUTSIDE_USER_RANGE;
+    if(e->env_tf.tf_cs != GD_KT && (pf->va < USTABDATA || pf->va >= UTOP)) {
+        pf->type = PAGEFAULT_TYPE_OUTSIDE_USER_RANGE;
+        return;
+    }
 
     /* Determine if the vma exists and is used */
-    vma_t * vma = vma_lookup(e, (void*)fault_va, 0);
-    if (!vma)
-        return PAGEFAULT_TYPE_NO_VMA;
-
-    if (vma->type == VMA_UNUSED)
-        return PAGEFAULT_TYPE_UNUSED_VMA;
-
-    /* Determine if the pte entry and vma specify a condition */
-    pte_t * pte = pgdir_walk(e->env_pgdir, (void*)fault_va, 0);
-    if (pte && (*pte & PTE_BIT_PRESENT)) {
-        /* Condition page present */
-        if (!(*pte & PTE_BIT_RW) && vma->perm & VMA_PERM_WRITE)
-            return PAGEFAULT_TYPE_COW;
+    pf->vma = vma_lookup(e, (void*)pf->va, 0);
+    if (!pf->vma)
+        pf->vma = vma_grow_down(e, pf->va);
+    if (!pf->vma) {
+        pf->type = PAGEFAULT_TYPE_NO_VMA;
+        return;
+    }
+
+    if (pf->vma->type == VMA_UNUSED) {
+        pf->type = PAGEFAULT_TYPE_UNUSED_VMA;
+        return;
+    }
+
+    /* Every fault changes the table, a table shared by fork is copied first */
+    if (PDE_IS_SHARED(e->env_pgdir[PDX(pf->va)]) &&
+            pgtable_unshare(e->env_pgdir, PDX(pf->va))) {
+        pf->type = PAGEFAULT_TYPE_NO_MEMORY;
+        return;
+    }
+
+    /* Single walk, pte stays 0 if there is no page table */
+    pf->pde = &e->env_pgdir[PDX(pf->va)];
+    if (*pf->pde & PDE_BIT_HUGE)
+        pf->pte = pf->pde;
+    else if (*pf->pde & PDE_BIT_PRESENT)
+        pf->pte = (pte_t*) KADDR(PDE_GET_ADDRESS(*pf->pde)) + PTX(pf->va);
+
+    /* The vma must allow the access at all */
+    if ((pf->err & FEC_WR) ? !(pf->vma->perm & VMA_PERM_WRITE) : !pf->vma->perm) {
+        pf->type = PAGEFAULT_TYPE_INVALID_PERMISSION;
+        return;
+    }
+
+    if (pf->err & FEC_PR) {
+        /* Page present: only a write to a read only (shared) page is ours */
+        if ((pf->err & FEC_WR) && (*pf->pte & PTE_BIT_RW))
+            pf->type = PAGEFAULT_TYPE_NONE; //stale tlb entry
+        else if ((pf->err & FEC_WR) && (*pf->pte & PTE_BIT_USER || !(pf->err & FEC_U)))
+            pf->type = PAGEFAULT_TYPE_COW;
         else
-            return PAGEFAULT_TYPE_INVALID_PERMISSION;
-    }else{
-        /* Condition page not present */
-        if (pte)
-            return PAGEFAULT_TYPE_SWAP;
-        
-        if (!pte && vma->backed_addr)
-            return PAGEFAULT_TYPE_FILEBACKED;
-
-        return PAGEFAULT_TYPE_NO_PTE;
+            pf->type = PAGEFAULT_TYPE_INVALID_PERMISSION;
+        return;
     }
 
-    return PAGEFAULT_TYPE_NONE;
+    /* Page not present (a swapped pte keeps its swap id) */
+    if (pf->pte && (*pf->pte & PTE_BIT_PRESENT))
+        pf->type = PAGEFAULT_TYPE_NONE; //resolved meanwhile
+    else if (pf->pte && *pf->pte)
+        pf->type = PAGEFAULT_TYPE_SWAP;
+    else if (pf->vma->backed_addr)
+        pf->type = PAGEFAULT_TYPE_FILEBACKED;
+    else
+        pf->type = PAGEFAULT_TYPE_NO_PTE;
 }
 
-void handle_pf_pte(uint32_t fault_va){
-    page_info_t * pp = page_alloc(ALLOC_ZERO);
-    if (!pp) {
-        cprintf("[PAGEFAULT] Dynamic allocation for %p failed.\n", fault_va);
-        murder_env(curenv, fault_va);
-    }
-    vma_t * vma = vma_lookup(curenv, (void*)fault_va, 0);
-    int perm = PTE_BIT_PRESENT | PTE_BIT_USER;
-    perm |= vma->perm & VMA_PERM_WRITE ? PTE_BIT_RW : 0;
-    int res = page_insert(curenv->env_pgdir, pp, (void*)(fault_va & 0xFFFFF000), perm);
-    if (res) {
-        cprintf("[PAGEFAULT] Failed to map page table: page allocation failed\n");
-        page_decref(pp);
-        murder_env(curenv, fault_va);
+int handle_pf_pte(pagefault_t *pf){
+    /* Zero page for the fault, plus readahead as advised */
+    if (vma_fault_around(curenv, pf->vma, pf->va, pf->err & FEC_WR)) {
+        cprintf("[PAGEFAULT] Dynamic allocation for %p failed.\n", pf->va);
+        return -1;
     }
+    return 0;
 }
 
-int handle_swap_fault(uint32_t fault_va) {
+int handle_swap_fault(pagefault_t *pf) {
+    /* The kernel is in the middle of a copy, read the page in right here */
+    if (pf->sync) {
+        uint32_t pageid = PTE_GET_PHYS_ADDRESS(*pf->pte) >> 12;
+        return swappy_swap_page_in(pageid, curenv, (void*) ROUNDDOWN(pf->va, PGSIZE),
+                SWAPPY_SWAP_DIRECT);
+    }
+
     /* Prepare pte */
-    dprintf("Swapped page fault %p: Queuing env %d for swaping...\n", fault_va, curenv->env_id);
+    dprintf("Swapped page fault %p: Queuing env %d for swaping...\n", pf->va, curenv->env_id);
     env_t * e = curenv;
-    pte_t * pte = pgdir_walk(e->env_pgdir, (void*)fault_va, 0);
-    
-    /* Try to retrieve page */
-    uint32_t pageid = PTE_GET_PHYS_ADDRESS(*pte) >> 12;
-    swappy_swap_page_in(pageid, e, (void*)fault_va, 0);
-    
-    /* Deschedule env */
-    e->env_status = ENV_WAITING_SWAP;
-    
-    sched_yield();
-    
-    return 0;
-}
 
-void page_fault_handler(struct trapframe *tf)
-{
-    uint32_t fault_va;
-    bool is_kernel;
+    /* Deschedule env before the swap thread may pick the request up */
+    wait_event(&swappy_swapin_wq, e, ENV_WAITING_SWAP);
 
-    /* Read processor's CR2 register to find the faulting address */
-    fault_va = rcr2();
+    /* Try to retrieve page */
+    uint32_t pageid = PTE_GET_PHYS_ADDRESS(*pf->pte) >> 12;
+    swappy_swap_page_in(pageid, e, (void*)pf->va, 0);
 
-    /* To allow on demand paging in kthreads, we must allow ring0 code accesses
-     * to addresses in the user address space. */
-    is_kernel = ((tf->tf_cs & 3) != 3) && fault_va >= USTACKTOP;
+    return 0;
+}
 
-    if(!curenv) {
-        panic("No curenv set");
-    }
+/**
+ * Classifies and handles the fault at tf, accounting it in pagefault_stats
+ * @param pf filled in
+ * @param tf
+ * @return 0 when resolved
+ */
+static int pagefault_resolve(pagefault_t *pf, struct trapframe *tf) {
+    uint64_t start = read_tsc();
+    int res = -1;
 
     /* Determine type of pagefault */
-    int pf_type = determine_pagefault(fault_va, is_kernel);
+    pagefault_init(pf, tf);
 
-    /* Handle all pagefaults */
+    /* Before handling, a swap fault may hand curenv to another CPU */
+    if (curenv)
+        curenv->env_rusage.ru_faults[pf->type]++;
 
-    switch (pf_type) {
+    /* Handle all pagefaults */
+    switch (pf->type) {
         case PAGEFAULT_TYPE_KERNEL:
             eprintf("Kernel pagefault.\n");
-            murder_env(curenv, fault_va);
             break;
         case PAGEFAULT_TYPE_OUTSIDE_USER_RANGE:
             eprintf("Page outside user accessable range.\n");
-            murder_env(curenv, fault_va);
             break;
         case PAGEFAULT_TYPE_INVALID_PERMISSION:
             eprintf("Page permissions insufficient.\n");
-            murder_env(curenv, fault_va);
             break;
         case PAGEFAULT_TYPE_NO_PTE:
-            eprintf("No page entry exists at %p.\n", fault_va);
-            handle_pf_pte(fault_va);
+            eprintf("No page entry exists at %p.\n", pf->va);
+            res = handle_pf_pte(pf);
             break;
         case PAGEFAULT_TYPE_NO_VMA:
             eprintf("Va outside VMA ranges.\n");
-            murder_env(curenv, fault_va);
             break;
         case PAGEFAULT_TYPE_UNUSED_VMA:
             eprintf("VA inside unused VMA range.\n");
-            murder_env(curenv, fault_va);
             break;
         case PAGEFAULT_TYPE_COW:
-            if (0)
-                return;
-            uint32_t preval = *(uint32_t * ) fault_va;
-            if (trap_handle_cow(fault_va)) {
+            if ((res = trap_handle_cow(pf)))
                 eprintf("COW failed.\n");
-                murder_env(curenv, fault_va);
-            }
-            uint32_t postval =*(uint32_t * ) fault_va;
-            assert(preval == postval);
             break;
         case PAGEFAULT_TYPE_FILEBACKED:
-            if (trap_handle_backed_memory(fault_va)) {
+            if ((res = trap_handle_backed_memory(pf)))
                 eprintf("file backing failed.\n");
-                murder_env(curenv, fault_va);
-            }
             break;
         case PAGEFAULT_TYPE_SWAP:
-            if (handle_swap_fault(fault_va)){
-                eprintf("file backing failed.\n");
-                murder_env(curenv, fault_va);
-            }
+            if ((res = handle_swap_fault(pf)))
+                eprintf("swap in failed.\n");
+            break;
+        case PAGEFAULT_TYPE_NO_MEMORY:
+            eprintf("Unsharing page table failed.\n");
             break;
         case PAGEFAULT_TYPE_NONE:
-            eprintf("No pagefault!\n");
+            dprintf("Page at %p was mapped meanwhile.\n", pf->va);
+            tlb_invalidate(curenv->env_pgdir, (void*)pf->va);
+            res = 0;
+            break;
         default:
-            panic("Unhandled pagefault type %d", pf_type);
+            panic("Unhandled pagefault type %d", pf->type);
+    }
+
+    pagefault_stats[cpunum()][pf->type].count++;
+    pagefault_stats[cpunum()][pf->type].cycles += read_tsc() - start;
+
+    return res;
+}
+
+void page_fault_handler(struct trapframe *tf)
+{
+    pagefault_t pf;
+
+    if(!curenv) {
+        panic("No curenv set");
     }
 
+    if (pagefault_resolve(&pf, tf)) {
+        murder_env(curenv, pf.va);
+        return;
+    }
 
     /* If we've reached this point, the memory fault should have been addressed properly */
-    dprintf("Page fault at (%#08x) should be fixed\n", fault_va);
+    dprintf("Page fault at (%#08x) should be fixed\n", pf.va);
+}
+
+/**
+ * Handles a fault of a user env's syscall touching user memory (uaccess.h)
+ *  The fault is resolved in-line or the access continues at its fixup, both
+ *  return straight to the faulting kernel code. curenv->env_tf holds the
+ *  user state and is left alone.
+ * @param tf trap frame on the kernel stack
+ * @return only if the faulting instruction does not access user memory
+ */
+static void trap_uaccess_fault(struct trapframe *tf) {
+    uintptr_t fixup = uaccess_fixup(tf->tf_eip, rcr2());
+    pagefault_t pf;
+
+    if (!fixup)
+        return;
+
+    if (pagefault_resolve(&pf, tf)) {
+        dprintf("user access at %p failed, continuing at %p\n", pf.va, fixup);
+        tf->tf_eip = fixup;
+    }
+
+    /* Intra ring iret, the frame has no esp/ss */
+    asm volatile(
+        "movl %0, %%esp\n"
+        "popal\n"
+        "popl %%es\n"
+        "popl %%ds\n"
+        "addl $0x8, %%esp\n" /* skip tf_trapno and tf_errcode */
+        "iret\n"
+        :: "g" (tf) : "memory");
+    panic("iret failed");
 }
 
 void breakpoint_handler(struct trapframe *tf) {
@@ -9,6 +9,7 @@
 #include <inc/trap.h>
 #include <inc/mmu.h>
 #include <kern/env.h>
+#include <inc/vma.h>
 
 #define IA32_SYSENTER_CS 0x0174
 #define IA32_SYSENTER_ESP 0x0175
@@ -67,23 +68,32 @@ void trap_irq_13();
 void trap_irq_ide();
 void trap_irq_15();
 void trap_irq_err();
+void trap_irq_resched();
 
 /* Special trap to host the sysenter opcode's call */
 void trap_sysenter();
 
-/* Page fault types */
-enum {
-    PAGEFAULT_TYPE_NONE = 0,
-    PAGEFAULT_TYPE_KERNEL,
-    PAGEFAULT_TYPE_OUTSIDE_USER_RANGE,
-    PAGEFAULT_TYPE_NO_VMA,
-    PAGEFAULT_TYPE_UNUSED_VMA,
-    PAGEFAULT_TYPE_INVALID_PERMISSION,
-    PAGEFAULT_TYPE_COW,
-    PAGEFAULT_TYPE_FILEBACKED,
-    PAGEFAULT_TYPE_NO_PTE,
-    PAGEFAULT_TYPE_SWAP,
-};
+/* Page fault context, filled once by pagefault_init and passed to the handlers */
+typedef struct pagefault {
+    uint32_t va;    /* Faulting address (cr2) */
+    uint32_t err;   /* Hardware error code, FEC_* */
+    vma_t *vma;     /* Vma containing va, 0 if none */
+    pde_t *pde;     /* Page directory entry of va */
+    pte_t *pte;     /* Page table entry of va (pde for huge pages), 0 if no table */
+    int type;       /* PAGEFAULT_TYPE_* */
+    int sync;       /* Kernel access to user memory, resolve without descheduling */
+} pagefault_t;
+
+/**
+ * Prints the number of faults and average cycles per fault for each type
+ */
+void pagefault_stats_dump();
+
+/**
+ * @param type PAGEFAULT_TYPE_*
+ * @return short name of the page fault type
+ */
+const char *pagefault_name(int type);
 
 
 void murder_env(env_t *env, uint32_t fault_va);
@@ -0,0 +1,185 @@
+/* 
+ * File:   uaccess.c
+ *
+ * Copying between kernel and user memory with exception fixups.
+ */
+
+#include "uaccess.h"
+#include "cpu.h"
+#include "env.h"
+#include "pmap.h"
+#include "vma.h"
+#include "inc/error.h"
+#include "inc/memlayout.h"
+#include "inc/string.h"
+
+typedef struct {
+    uintptr_t insn;
+    uintptr_t fixup;
+} uaccess_ex_entry;
+
+/* Collected by the linker, see kern/kernel.ld */
+extern const uaccess_ex_entry __EX_TABLE_BEGIN__[], __EX_TABLE_END__[];
+
+/* Failed address of the last aborted access, per cpu */
+static uintptr_t uaccess_fault_vas[NCPU];
+
+/**
+ * Checks that va to va+len lies below UTOP, the kernel is never copied
+ *  from or to. This is arithmetic only, see __uaccess_perm_ok for rights.
+ */
+static int __uaccess_range_ok(const void *va, size_t len) {
+    uintptr_t start = (uintptr_t) va;
+
+    if (start + len < start || start + len > UTOP) {
+        uaccess_fault_vas[cpunum()] = start;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Checks the rights the MMU does not enforce at CPL0: a supervisor read of
+ *  a present page without the user bit (a no access vma) does not fault.
+ *  Every page needs a vma allowing the access and, if present, the user
+ *  bit. Missing pages are left to the fault path.
+ * @param va
+ * @param len
+ * @param perm VMA_PERM_READ or VMA_PERM_WRITE
+ * @return 1 if the range may be accessed
+ */
+static int __uaccess_perm_ok(const void *va, size_t len, int perm) {
+    uintptr_t i = ROUNDDOWN((uintptr_t) va, PGSIZE);
+    uintptr_t end = (uintptr_t) va + len;
+    pde_t pde;
+    pte_t *pte;
+    vma_t *vma = 0;
+
+    if (!curenv || !curenv->vma_list)
+        return 1;
+
+    for (; i < end; i += PGSIZE) {
+        if (!vma || i >= (uintptr_t) vma->va + vma->len)
+            vma = vma_lookup(curenv, (void *) i, 0);
+        if (vma && !(vma->perm & perm))
+            goto fail;
+
+        pde = curenv->env_pgdir[PDX(i)];
+        if (!(pde & PDE_BIT_PRESENT))
+            continue;
+        if (pde & PDE_BIT_HUGE) {
+            if (!(pde & PTE_BIT_USER))
+                goto fail;
+            continue;
+        }
+        pte = (pte_t *) KADDR(PDE_GET_ADDRESS(pde)) + PTX(i);
+        if ((*pte & PTE_BIT_PRESENT) && !(*pte & PTE_BIT_USER))
+            goto fail;
+    }
+    return 1;
+
+fail:
+    uaccess_fault_vas[cpunum()] = MAX(i, (uintptr_t) va);
+    return 0;
+}
+
+/**
+ * Copies dword wise, then the tail byte wise
+ *  Both string instructions may fault, a resolved fault resumes the copy.
+ */
+static int __uaccess_copy(void *dst, const void *src, size_t len) {
+    int r;
+
+    asm volatile(
+        "   movl %%ecx, %%eax\n"
+        "   shrl $2, %%ecx\n"
+        "1: rep movsl\n"
+        "   movl %%eax, %%ecx\n"
+        "   andl $3, %%ecx\n"
+        "2: rep movsb\n"
+        "   xorl %%eax, %%eax\n"
+        "   jmp 4f\n"
+        "3: movl %4, %%eax\n"
+        "4:\n"
+        UACCESS_EX_ENTRY("1b", "3b")
+        UACCESS_EX_ENTRY("2b", "3b")
+        : "=&a" (r), "+D" (dst), "+S" (src), "+c" (len)
+        : "i" (-E_FAULT)
+        : "memory", "cc");
+
+    return r;
+}
+
+int copy_from_user(void *dst, const void *src, size_t len) {
+    if (!__uaccess_range_ok(src, len) || !__uaccess_perm_ok(src, len, VMA_PERM_READ))
+        return -E_FAULT;
+    return __uaccess_copy(dst, src, len);
+}
+
+int copy_to_user(void *dst, const void *src, size_t len) {
+    if (!__uaccess_range_ok(dst, len) || !__uaccess_perm_ok(dst, len, VMA_PERM_WRITE))
+        return -E_FAULT;
+    return __uaccess_copy(dst, src, len);
+}
+
+int strncpy_from_user(char *dst, const char *src, size_t len) {
+    size_t n = 0, chunk;
+    int slen;
+
+    /* Page by page, the page of the terminator is readable as a whole */
+    while (n < len) {
+        chunk = MIN(len - n, PGSIZE - ((uintptr_t) (src + n) & (PGSIZE - 1)));
+        if (copy_from_user(dst + n, src + n, chunk))
+            return -E_FAULT;
+        if ((slen = strnlen(dst + n, chunk)) < chunk)
+            return n + slen;
+        n += chunk;
+    }
+
+    return len;
+}
+
+int probe_user(const void *va, size_t len) {
+    uintptr_t i = (uintptr_t) va;
+    uintptr_t end = i + len;
+    int r;
+
+    if (!__uaccess_range_ok(va, len) || !__uaccess_perm_ok(va, len, VMA_PERM_READ))
+        return -E_FAULT;
+
+    /* One load per page, the first at va itself */
+    while (i < end) {
+        asm volatile(
+            "1: movb (%1), %%al\n"
+            "   xorl %%eax, %%eax\n"
+            "   jmp 3f\n"
+            "2: movl %2, %%eax\n"
+            "3:\n"
+            UACCESS_EX_ENTRY("1b", "2b")
+            : "=&a" (r)
+            : "r" (i), "i" (-E_FAULT)
+            : "memory");
+        if (r)
+            return r;
+        i = ROUNDDOWN(i, PGSIZE) + PGSIZE;
+    }
+
+    return 0;
+}
+
+uintptr_t uaccess_fault_va() {
+    return uaccess_fault_vas[cpunum()];
+}
+
+uintptr_t uaccess_fixup(uintptr_t eip, uintptr_t va) {
+    const uaccess_ex_entry *ent;
+
+    for (ent = __EX_TABLE_BEGIN__; ent < __EX_TABLE_END__; ent++) {
+        if (ent->insn == eip) {
+            uaccess_fault_vas[cpunum()] = va;
+            return ent->fixup;
+        }
+    }
+
+    return 0;
+}
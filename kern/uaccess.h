@@ -0,0 +1,74 @@
+/* 
+ * File:   uaccess.h
+ *
+ * Copying between kernel and user memory without validating the range up
+ * front. The copy runs optimistically, a page fault on a user address is
+ * resolved in-line when a vma allows the access (demand paging, COW, swap).
+ * Any other fault is turned into -E_FAULT through the exception table: each
+ * instruction which may touch user memory has an entry pointing at the code
+ * which aborts the copy.
+ */
+
+#ifndef UACCESS_H
+#define UACCESS_H
+#include "inc/types.h"
+
+/* Emits an exception table entry: a fault at insn continues at fixup */
+#define UACCESS_EX_ENTRY(insn, fixup)           \
+    ".pushsection __ex_table, \"a\"\n"          \
+    "    .long " insn ", " fixup "\n"           \
+    ".popsection\n"
+
+/**
+ * Copies len bytes from user address src to kernel buffer dst
+ * @param dst
+ * @param src
+ * @param len
+ * @return 0 on success, -E_FAULT if the range is not readable user memory
+ */
+int copy_from_user(void *dst, const void *src, size_t len);
+
+/**
+ * Copies len bytes from kernel buffer src to user address dst
+ * @param dst
+ * @param src
+ * @param len
+ * @return 0 on success, -E_FAULT if the range is not writable user memory
+ */
+int copy_to_user(void *dst, const void *src, size_t len);
+
+/**
+ * Copies the string at user address src into dst, at most len bytes
+ *  Never reads past the page holding the terminating 0.
+ * @param dst
+ * @param src
+ * @param len size of dst
+ * @return length of the string, len if it did not fit (dst is then not
+ *         terminated), -E_FAULT if the string is not readable user memory
+ */
+int strncpy_from_user(char *dst, const char *src, size_t len);
+
+/**
+ * Touches every page of va to va+len once, so faults are taken up front
+ *  Used where nothing may happen unless the whole range is readable.
+ * @param va
+ * @param len
+ * @return 0 on success, -E_FAULT if the range is not readable user memory
+ */
+int probe_user(const void *va, size_t len);
+
+/**
+ * Returns the address of the last failed user access on this cpu
+ */
+uintptr_t uaccess_fault_va();
+
+/**
+ * Looks up the fixup for a faulting kernel instruction, called by the
+ *  page fault handler. Records va as the failed address.
+ * @param eip faulting instruction
+ * @param va faulting address
+ * @return fixup address, 0 if eip does not access user memory
+ */
+uintptr_t uaccess_fixup(uintptr_t eip, uintptr_t va);
+
+#endif /* UACCESS_H */
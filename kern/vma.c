@@ -1,22 +1,72 @@
 #include "pmap.h"
 
 #include "../kern/vma.h"
+#include "../kern/swappy.h"
+#include "../kern/pagecache.h"
+#include "../kern/shm.h"
 
 #include "../inc/env.h"
 #include "../inc/mmu.h"
 #include "../inc/types.h"
+#include "../inc/error.h"
+#include "../inc/x86.h"
 #include "../inc/stdio.h"
 #include "../inc/assert.h"
 #include "../inc/string.h"
 #include "../inc/memlayout.h"
 
-void __dealloc_range(env_t *e, void *va, size_t len) {
+/* Read only frame shared by all untouched anonymous pages */
+page_info_t *vma_zero_page = 0;
+
+void vma_zero_page_init() {
+    assert(!vma_zero_page);
+    vma_zero_page = page_alloc(ALLOC_ZERO);
+    if (!vma_zero_page)
+        panic("vma_zero_page_init: out of memory");
+
+    /* The kernel keeps one reference, it is never freed */
+    page_inc_ref(vma_zero_page);
+}
+
+uint32_t vma_zero_page_refs() {
+    return page_get_ref(vma_zero_page) - 1;
+}
+
+/**
+ * Copies the page tables of [start, end) that are still shared by fork,
+ *  so that changing their entries afterwards cannot fail half way
+ * @return 0 on success, -E_NO_MEM if a table could not be copied
+ */
+static int __unshare_range(env_t *e, uint32_t start, uint32_t end) {
+    for (uint32_t i = ROUNDDOWN(start, PTSIZE); i < end; i += PTSIZE)
+        if (PDE_IS_SHARED(e->env_pgdir[PDX(i)]) && pgtable_unshare(e->env_pgdir, PDX(i)))
+            return -E_NO_MEM;
+    return 0;
+}
+
+/**
+ * Unmaps and releases the pages and swap slots of [va, va + len)
+ * @return 0 on success, -E_NO_MEM (nothing released) if a table shared by
+ *  fork could not be copied
+ */
+int __dealloc_range(env_t *e, void *va, size_t len) {
     uint32_t i = (uint32_t) va & 0xFFFFF000; //round down to pgsize
     uint32_t end = (uint32_t) va + len;
 
+    if (__unshare_range(e, i, end))
+        return -E_NO_MEM;
+
     for(; i<end; i+= PGSIZE) {
-        pte_t * pte = pgdir_walk(e->env_pgdir, (void*)i, 0);
-        if (pte) {
+        pte_t * pte = pgdir_walk(e->env_pgdir, (void*)i, WALK_WRITE);
+
+        /* Swapped out: only release the swap slot */
+        if (pte && *pte && !(*pte & PTE_BIT_PRESENT)) {
+            swappy_drop_swapped(*pte);
+            *pte = 0;
+            continue;
+        }
+
+        if (pte && (*pte & PTE_BIT_PRESENT)) {
             uint32_t pa = PTE_GET_PHYS_ADDRESS(*pte);
             if (pa) {
                 struct page_info * pp = pa2page(pa);
@@ -29,6 +79,31 @@ void __dealloc_range(env_t *e, void *va, size_t len) {
             }
         }
     }
+
+    return 0;
+}
+
+/**
+ * Writes the dirty pages of a disk backed vma in [start, end) back to disk
+ *  and cleans their pte's, other vma's are ignored.
+ */
+static void __vma_writeback(env_t *e, vma_t *vma, uint32_t start, uint32_t end) {
+    if (vma->type != VMA_SHARED || !((shm_t*) vma->backed_addr)->disk)
+        return;
+
+    start = MAX(start, (uint32_t) vma->va);
+    end = MIN(end, (uint32_t) vma->va + vma->len);
+
+    for (uint32_t i = start; i < end; i += PGSIZE) {
+        pte_t *pte = pgdir_walk(e->env_pgdir, (void*) i, WALK_WRITE);
+        if (!pte || (*pte & (PTE_BIT_PRESENT | PTE_BIT_DIRTY)) != (PTE_BIT_PRESENT | PTE_BIT_DIRTY))
+            continue;
+
+        /* Clean first, a write during the transfer dirties the page again */
+        *pte &= ~PTE_BIT_DIRTY;
+        tlb_invalidate(e->env_pgdir, (void*) i);
+        shm_writeback(vma->backed_addr, (vma->offset + i - (uint32_t) vma->va) / PGSIZE);
+    }
 }
 
 int vma_array_init(env_t* e) {
@@ -70,10 +145,14 @@ void vma_array_destroy(env_t* e) {
     uint32_t i;
     vma_t *cur;
 
+    /* env_free_vm released the shared tables, unmapping cannot fail */
     for(i = 0; i < VMA_ARRAY_SIZE; i++) {
         cur = &vma_arr->vmas[i];
         if(cur->va) {
+            __vma_writeback(e, cur, (uint32_t) cur->va, (uint32_t) cur->va + cur->len);
             __dealloc_range(e, cur->va, cur->len);
+            if (cur->type == VMA_SHARED)
+                shm_decref(cur->backed_addr);
         }
     }
 
@@ -96,16 +175,21 @@ const uint8_t vma_get_index(vma_t* vma) {
 }
 
 void vma_remove(env_t *e, vma_t * vma) {
-    uint8_t idx = vma_get_index(vma);
-    
-    vma_t *p, *n;
-    p = vma->p_adj == VMA_INVALID_POINTER ? 0 : &e->vma_list->vmas[vma->p_adj];
-    n = vma->n_adj == VMA_INVALID_POINTER ? 0 : &e->vma_list->vmas[vma->n_adj];
-    
-    /* Make p->n && p<-n*/
-    p->n_adj = vma->n_adj;
-    n->p_adj = vma->p_adj;
-    
+    vma_arr_t *vmar = e->vma_list;
+
+    /* Make p->n && p<-n, the head has no p */
+    if (vma->p_adj == VMA_INVALID_INDEX)
+        vmar->lowest_va_vma = vma->n_adj;
+    else
+        vmar->vmas[vma->p_adj].n_adj = vma->n_adj;
+
+    if (vma->n_adj != VMA_INVALID_INDEX)
+        vmar->vmas[vma->n_adj].p_adj = vma->p_adj;
+
+    /* The shared object may outlive us in other envs */
+    if (vma->type == VMA_SHARED)
+        shm_decref(vma->backed_addr);
+
     /* empty region */
     memset((void*)vma, 0, sizeof(vma_t));
 }
@@ -117,6 +201,25 @@ void vma_set_backing(env_t* e, int vma_index, void * addr, uint32_t len) {
         vma->backsize = len;
 }
 
+void vma_set_shared(env_t* e, int vma_index, shm_t *shm, uint32_t offset) {
+        vma_t * vma = &e->vma_list->vmas[vma_index];
+        assert(vma->type == VMA_SHARED && vma->backed_addr == 0);
+        shm_incref(shm);
+        vma->backed_addr = shm;
+        vma->offset = offset;
+}
+
+void vma_array_copy(env_t *dst, env_t *src) {
+    memcpy(dst->vma_list, src->vma_list, sizeof(vma_arr_t));
+
+    /* Every copied shared vma maps the object once more */
+    for (uint32_t i = 0; i < VMA_ARRAY_SIZE; i++) {
+        vma_t *vma = &dst->vma_list->vmas[i];
+        if (!vma_is_empty(vma) && vma->type == VMA_SHARED)
+            shm_incref(vma->backed_addr);
+    }
+}
+
 int vma_get_relative(vma_t * vma1, vma_t * vma2) {
     uint32_t vlen1, vlen2, va1, va2;
     
@@ -153,158 +256,560 @@ int vma_get_relative(vma_t * vma1, vma_t * vma2) {
     panic("This function is faulty! (and I'm now salty)");
 }
 
+/**
+ * Finds an unused entry in the vma array
+ * @param vmar
+ * @return pointer to a free entry, 0 if the array is full
+ */
+static vma_t *__vma_find_free(vma_arr_t *vmar) {
+    uint32_t i;
+    for(i = 0; i < VMA_ARRAY_SIZE; i++)
+        if (vma_is_empty(&vmar->vmas[i])) //if len is zero, we a sure its empty :)
+            return &vmar->vmas[i];
+    return 0;
+}
+
+/**
+ * Checks if vma b directly follows vma a and both describe the same mapping
+ *  Backed vma's are never merged, their backing offsets are per vma.
+ */
+static int __vma_can_merge(vma_t *a, vma_t *b) {
+    if ((uint32_t) a->va + a->len != (uint32_t) b->va)
+        return 0;
+    if (a->type != VMA_ANON || b->type != VMA_ANON)
+        return 0;
+    if (a->backed_addr || b->backed_addr)
+        return 0;
+    if (a->flags & VMA_FLAG_GROWSDOWN || b->flags & VMA_FLAG_GROWSDOWN)
+        return 0;
+    return a->perm == b->perm && a->advice == b->advice;
+}
+
 int vma_new(env_t *e, void *va, size_t len, int perm, int type) {
     /* vma assertions */
     assert(len);
-    
-    /* pg allign */
-    len = ROUNDUP(len, PGSIZE);
-    
+
+    /* pg allign (the unaligned head is part of the first page) */
+    len = ROUNDUP(len + ((uint32_t)va & 0xFFF), PGSIZE);
+
     /* Create and map a empty vma and link in the va order */
-    uint32_t i;
     vma_arr_t * vmar = e->vma_list;
-    vma_t * entry;
-    
-    /* Find a free spot in the array */
-    for(i = 0; i < VMA_ARRAY_SIZE; i++) {
-        entry = &vmar->vmas[i];
-        if (vma_is_empty(entry)) //if len is zero, we a sure its empty :) (or atleast useless)
-            goto breaky;
-    }
-    entry = 0;
-breaky:
+    vma_t * entry = __vma_find_free(vmar);
     assert(entry);
+    uint8_t i = vma_get_index(entry);
 
     /* Fill entry values */
     entry->va = (void*)((uint32_t)va & 0xFFFFF000);
     entry->backed_start_offset = (uint16_t)((uint32_t)va & 0xFFF);
     entry->len = len;
     entry->perm = perm;
-    entry->type = type; 
+    entry->type = type;
+    entry->advice = VMA_ADVICE_NORMAL;
+    entry->flags = 0;
     entry->backed_addr = 0;
     entry->backsize = 0;
-    
-    
-   if (vma_lookup(e, va, len)!=0) {
-       cprintf("Assertion failed in vma_new!\n");
-       vma_dump_all(e);
+    entry->offset = 0;
+
+    /* Look with our own entry still unlinked, so we only find others */
+    if (vma_lookup(e, entry->va, len)!=0) {
+        cprintf("Assertion failed in vma_new!\n");
+        vma_dump_all(e);
         cprintf("To be inserted: ");
-        if (entry)
-            vma_dump(entry);
+        vma_dump(entry);
         cprintf("\n");
         memset((void*)entry, 0, sizeof(vma_t));
         return VMA_ERR_VMA_EXISTS;
-   }
-    
-    /* 
-     * Fit it inside linked indexes 
-     *  This checks if it will actually fit as well
-     */
-    //First entry case
-    if (vmar->lowest_va_vma == VMA_INVALID_INDEX) {
-        vmar->lowest_va_vma = i;
-        entry->n_adj = entry->p_adj = VMA_INVALID_INDEX;
-        return i;
     }
-    
-    
-    /* Loop over all entries to find a comfortable spot */
-    //Current, previous and next entry
-    vma_t *centry, *pentry, *nentry;
-    
-    //bootstrap
-    centry = pentry = 0;
-    nentry = &vmar->vmas[vmar->lowest_va_vma];
-    
-    /* Check if we map in the first area */
-    int bmap =  vma_get_relative(entry, nentry);
-    
-    /* Case: we map before the first vma, TODO: merge*/
-    if (bmap == VMA_RELATIVE_BEFORE_NADJ || bmap == VMA_RELATIVE_AFTER_ADJ) {
-        //Insert before first entry
-        entry->n_adj = vmar->lowest_va_vma;
-        entry->p_adj = VMA_INVALID_INDEX;
+
+    /* Find the last entry which lies below us */
+    vma_t *prev = 0;
+    uint8_t next_i = vmar->lowest_va_vma;
+    while (next_i != VMA_INVALID_INDEX && vmar->vmas[next_i].va < entry->va) {
+        prev = &vmar->vmas[next_i];
+        next_i = prev->n_adj;
+    }
+
+    /* Link in between prev and next */
+    entry->p_adj = prev ? vma_get_index(prev) : VMA_INVALID_INDEX;
+    entry->n_adj = next_i;
+    if (prev)
+        prev->n_adj = i;
+    else
         vmar->lowest_va_vma = i;
-        nentry->p_adj = i;
-        return i;
+    if (next_i != VMA_INVALID_INDEX)
+        vmar->vmas[next_i].p_adj = i;
+
+    return i;
+}
+
+vma_t * vma_split(vma_t * vma, void * va) {
+    /* The vma array is page alligned, so we can find it from any entry */
+    vma_arr_t *vmar = (vma_arr_t *) ((uint32_t) vma & 0xFFFFF000);
+    uint32_t split = (uint32_t) va & 0xFFFFF000;
+    uint32_t offset;
+    vma_t *entry;
+    uint8_t i;
+
+    /* Split point must lie strictly inside the vma */
+    if (split <= (uint32_t) vma->va || split >= (uint32_t) vma->va + vma->len)
+        return 0;
+
+    entry = __vma_find_free(vmar);
+    if (!entry) {
+        cprintf("vma_split: No free vma entries left\n");
+        return 0;
     }
-    
-    //Loop while next != 0 (nentry)
-    while(nentry) {
-        //Shift and create pointers
-        pentry = centry;
-        centry = nentry;
-        nentry = centry->n_adj == VMA_INVALID_POINTER ? 0 : &vmar->vmas[centry->n_adj];
-        
-        /* Quick and dirty position determination */
-        int check = centry->va < va;
-        check &= nentry ? nentry->va > va : 1;
-        if (check) { 
-            /* Insertion splot reached: insert between centry & nentry */
-            
-            //Our positional relation vs the current entry
-            int pos_c = vma_get_relative(entry, centry);
-            //Our positional relation vs the next entry
-            int pos_n = nentry ? vma_get_relative(entry, nentry) : 0;
-            
-            
-            /* Check merge conditions */
-            
-            //If we are adjacent to the current ( [current][us] )
-            if (pos_c == VMA_RELATIVE_AFTER_ADJ) {
-                /* merge with centry if permissions match */
-                if (entry->perm == centry->perm && entry->type == centry->type && centry->backsize == 0) {
-                    centry->len += entry->len;
-                    
-                    /* Clear our allocated entry */
-                    memset((void*)entry, 0, sizeof(vma_t));
-                    
-                    /* return index */
-                    return vma_get_index(centry);
-                }
-            }
-            
-            //If we are adjacent to the next entry ( [us][next] )
-            if (pos_n == VMA_RELATIVE_BEFORE_ADJ) {
-                /* merge with centry if permissions match */
-                if (entry->perm == nentry->perm && entry->type == nentry->type && nentry->backsize == 0) {
-                    nentry->len += (uint32_t)(nentry->va - entry->va);
-                    nentry->va = entry->va;
-                    
-                    /* Clear our allocated entry */
-                    memset((void*)entry, 0, sizeof(vma_t));
-                    
-                    /* return index */
-                    return vma_get_index(pentry);
-                }
-            }
-            
-            /* Insert entry */
-            if (va > centry->va) {
-                entry->n_adj = nentry ? vma_get_index(nentry) : VMA_INVALID_POINTER;
-                entry->p_adj = vma_get_index(centry);
-                centry->n_adj = i;
-                if (nentry) nentry->p_adj = i;
-            }else {
-                entry->n_adj = vma_get_index(centry);
-                entry->p_adj = pentry ? vma_get_index(pentry) : VMA_INVALID_POINTER;
-                centry->p_adj = i;
-                if (pentry) pentry->n_adj = i;
-            }
-            
-            return i;
+    i = vma_get_index(entry);
+
+    /* Second half is a copy of us starting at split */
+    *entry = *vma;
+    offset = split - (uint32_t) vma->va;
+    entry->va = (void *) split;
+    entry->len = vma->len - offset;
+    vma->len = offset;
+
+    /* Second half continues the backing where the first half stops */
+    if (vma->type == VMA_SHARED) {
+        entry->offset = vma->offset + offset;
+        shm_incref(vma->backed_addr);
+    } else if (vma->backed_addr) {
+        uint32_t consumed = offset - vma->backed_start_offset;
+        entry->backed_addr = vma->backed_addr + consumed;
+        entry->backed_start_offset = 0;
+        entry->backsize = vma->backsize > consumed ? vma->backsize - consumed : 0;
+    }
+
+    /* Only the lowest part of a stack grows */
+    entry->flags &= ~VMA_FLAG_GROWSDOWN;
+
+    /* Link: vma -> entry -> old next */
+    entry->p_adj = vma_get_index(vma);
+    entry->n_adj = vma->n_adj;
+    if (vma->n_adj != VMA_INVALID_INDEX)
+        vmar->vmas[vma->n_adj].p_adj = i;
+    vma->n_adj = i;
+
+    return entry;
+}
+
+vma_t * vma_merge(env_t *e, vma_t * vma) {
+    vma_arr_t *vmar = e->vma_list;
+    vma_t *other;
+
+    /* Absorb our successor */
+    if (vma->n_adj != VMA_INVALID_INDEX) {
+        other = &vmar->vmas[vma->n_adj];
+        if (__vma_can_merge(vma, other)) {
+            vma->len += other->len;
+            vma_remove(e, other);
         }
     }
-    
-    vma_dump_all(e);
-    cprintf("To be inserted: ");
-    if (entry->va)
-        vma_dump(entry);
-    cprintf("\n");
-    panic("What are we doing here? This code should not be reached!");
+
+    /* Let our predecessor absorb us */
+    if (vma->p_adj != VMA_INVALID_INDEX) {
+        other = &vmar->vmas[vma->p_adj];
+        if (__vma_can_merge(other, vma)) {
+            other->len += vma->len;
+            vma_remove(e, vma);
+            vma = other;
+        }
+    }
+
+    return vma;
+}
+
+/**
+ * Applies vma permissions to all pte's in [start, end)
+ *  Shared pages do not get write access, they will be COW'ed on write.
+ *  Swapped pte's keep their permission bits, so they are updated as well.
+ *  Does not flush the TLB.
+ */
+static void __protect_range(env_t *e, uint32_t start, uint32_t end, int perm) {
+    uint32_t i;
+    pte_t *pte;
+
+    for(i = start; i < end; i += PGSIZE) {
+        /* Skip whole page tables which do not exist */
+        if (!(e->env_pgdir[PDX(i)] & PDE_BIT_PRESENT)) {
+            i = ROUNDDOWN(i, PTSIZE) + PTSIZE - PGSIZE;
+            continue;
+        }
+
+        /* Huge pages are never mapped for user vma's */
+        if (e->env_pgdir[PDX(i)] & PDE_BIT_HUGE)
+            continue;
+
+        pte = pgdir_walk(e->env_pgdir, (void*) i, WALK_WRITE);
+        if (!pte || !*pte)
+            continue;
+
+        /* No access at all: hide page from user */
+        if (!perm) {
+            *pte &= ~(uint32_t)(PTE_BIT_USER | PTE_BIT_RW);
+            continue;
+        }
+
+        *pte |= PTE_BIT_USER;
+        if (!(perm & VMA_PERM_WRITE))
+            *pte &= ~(uint32_t)PTE_BIT_RW;
+        else if ((*pte & PTE_BIT_PRESENT) &&
+                page_get_ref(pa2page(PTE_GET_PHYS_ADDRESS(*pte))) <= 1)
+            *pte |= PTE_BIT_RW;
+    }
+}
+
+/**
+ * Checks if [start, end) is completely covered by vma's
+ */
+static int __vma_range_mapped(env_t *e, uint32_t start, uint32_t end) {
+    uint32_t i;
+    vma_t *entry;
+
+    for(i = start; i < end; i = (uint32_t) entry->va + entry->len) {
+        entry = vma_lookup(e, (void*) i, 0);
+        if (!entry)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Splits the vma containing va so that it starts at va and ends at or before end
+ * @return the isolated vma, 0 if the split failed
+ */
+static vma_t *__vma_isolate(env_t *e, uint32_t va, uint32_t end) {
+    vma_t *entry = vma_lookup(e, (void*) va, 0);
+
+    if ((uint32_t) entry->va < va)
+        entry = vma_split(entry, (void*) va);
+    if (!entry)
+        return 0;
+    if ((uint32_t) entry->va + entry->len > end && !vma_split(entry, (void*) end))
+        return 0;
+
+    return entry;
+}
+
+int vma_protect(env_t *e, void *va, size_t len, int perm) {
+    uint32_t start = ROUNDDOWN((uint32_t) va, PGSIZE);
+    uint32_t end = ROUNDUP((uint32_t) va + len, PGSIZE);
+    uint32_t i;
+    vma_t *entry;
+
+    /* The whole range must be covered by vma's */
+    if (!__vma_range_mapped(e, start, end))
+        return -E_INVAL;
+
+    /* Before any vma changes, the pte's must follow */
+    if (__unshare_range(e, start, end))
+        return -E_NO_MEM;
+
+    /* Cut the vma's at the range borders and apply the permissions */
+    for(i = start; i < end;) {
+        if (!(entry = __vma_isolate(e, i, end)))
+            break;
+
+        entry->perm = perm;
+        i = (uint32_t) entry->va + entry->len;
+        vma_merge(e, entry);
+    }
+
+    /* Update all pte's in bulk and flush once. A failed split leaves
+     * [start, i) changed, its pte's must match the vma's regardless. */
+    __protect_range(e, start, i, perm);
+    if (e == curenv)
+        tlbflush();
+
+    return i < end ? -E_NO_MEM : 0;
+}
+
+/**
+ * Copies the backing of vma for the page at page_offset into dst
+ *  The backing covers [backed_start_offset, backed_start_offset + backsize)
+ *  relative to the (page alligned) vma start, the rest is left untouched (zero).
+ */
+static void __vma_fill_page(vma_t *vma, uint32_t page_offset, char *dst) {
+    uint32_t lo = MAX(page_offset, (uint32_t) vma->backed_start_offset);
+    uint32_t hi = MIN(page_offset + PGSIZE, vma->backed_start_offset + vma->backsize);
+    if (lo < hi)
+        memcpy(dst + (lo - page_offset),
+                (char*) vma->backed_addr + (lo - vma->backed_start_offset),
+                hi - lo);
+}
+
+/**
+ * Allocates a zeroed page, dropping unused page cache pages when memory
+ *  runs out
+ * @return the page, 0 if there is none
+ */
+static page_info_t *__vma_page_alloc(void) {
+    page_info_t *pp = page_alloc(ALLOC_ZERO);
+
+    if (!pp && pagecache_shrink())
+        pp = page_alloc(ALLOC_ZERO);
+    return pp;
+}
+
+/**
+ * Gets the page for a binary backed vma at page_offset from the page cache,
+ *  filling and caching it on a miss.
+ * @param shared set to 1 if the returned page is the cached (shared) one,
+ *  the caller then holds a reference to it
+ * @return the page, 0 on allocation failure
+ */
+static page_info_t *__vma_cached_page(vma_t *vma, uint32_t page_offset, int *shared) {
+    /* Key: where the page content starts in the image and where the backing ends */
+    uint32_t src = (uint32_t) vma->backed_addr - vma->backed_start_offset + page_offset;
+    uint32_t end = (uint32_t) vma->backed_addr + vma->backsize;
+    page_info_t *pp, *cached;
+
+    *shared = 1;
+    if ((pp = pagecache_lookup(src, end)))
+        return pp;
+
+    if (!(pp = __vma_page_alloc()))
+        return 0;
+    __vma_fill_page(vma, page_offset, page2kva(pp));
+
+    /* Cache full: use the page privately */
+    if (!(cached = pagecache_insert(src, end, pp))) {
+        *shared = 0;
+        return pp;
+    }
+
+    /* Another cpu filled it first */
+    if (cached != pp)
+        page_free(pp);
+
+    return cached;
+}
+
+int vma_populate_page(env_t *e, vma_t *vma, uint32_t va, int write) {
+    page_info_t *pp;
+    int shared = 0;
+    int owned = 1;
+    int cached = 0;
+
+    va = ROUNDDOWN(va, PGSIZE);
+
+    /* Present or swapped pages are left alone */
+    pte_t *pte = pgdir_walk(e->env_pgdir, (void*) va, 0);
+    if (pte && *pte)
+        return 0;
+
+    /* Binary images are shared through the page cache, the rest is private */
+    if (vma->type == VMA_SHARED) {
+        /* Shared objects own their pages, all mappers write the same frame */
+        pp = shm_page(vma->backed_addr, (vma->offset + va - (uint32_t) vma->va) / PGSIZE);
+        owned = 0;
+    } else if (vma->backed_addr && vma->type == VMA_BINARY) {
+        pp = __vma_cached_page(vma, va - (uint32_t) vma->va, &shared);
+        cached = shared;
+    } else if (!vma->backed_addr && !write &&
+            page_get_ref(vma_zero_page) < VMA_ZERO_PAGE_MAX_REF) {
+        /* Reading untouched memory, zeros until the first write */
+        pp = vma_zero_page;
+        shared = 1;
+    } else {
+        pp = __vma_page_alloc();
+        if (pp && vma->backed_addr)
+            __vma_fill_page(vma, va - (uint32_t) vma->va, page2kva(pp));
+    }
+    if (!pp)
+        return -E_NO_MEM;
+
+    /* Protected (no access) pages are mapped without the user bit */
+    int perm = PTE_BIT_PRESENT;
+    perm |= vma->perm ? PTE_BIT_USER : 0;
+
+    /* Cached and zero pages are never writable, a write copies them (COW) */
+    perm |= vma->perm & VMA_PERM_WRITE && !shared ? PTE_BIT_RW : 0;
+
+    int r = page_insert(e->env_pgdir, pp, (void*) va, perm);
+
+    /* The mapping holds its own reference now */
+    if (cached)
+        page_decref(pp);
+    if (r) {
+        if (!shared && owned)
+            page_free(pp);
+        return -E_NO_MEM;
+    }
+
     return 0;
 }
 
+int vma_fault_around(env_t *e, vma_t *vma, uint32_t fault_va, int write) {
+    uint32_t va = ROUNDDOWN(fault_va, PGSIZE);
+    uint32_t vma_end = (uint32_t) vma->va + vma->len;
+    uint32_t start, end, i;
+    int r;
+
+    /* The faulting page itself must succeed */
+    if ((r = vma_populate_page(e, vma, va, write)))
+        return r;
+
+    /* Determine the window to map along */
+    switch (vma->advice) {
+        case VMA_ADVICE_RANDOM:
+            return 0;
+        case VMA_ADVICE_SEQUENTIAL:
+            start = va + PGSIZE;
+            end = va + VMA_READAHEAD_PAGES * PGSIZE;
+            break;
+        default:
+            /* Only backed memory is cheap enough to map around blindly */
+            if (!vma->backed_addr)
+                return 0;
+            start = ROUNDDOWN(va, VMA_FAULTAROUND_PAGES * PGSIZE);
+            end = start + VMA_FAULTAROUND_PAGES * PGSIZE;
+            break;
+    }
+
+    start = MAX(start, (uint32_t) vma->va);
+    end = MIN(end, vma_end);
+
+    /* Best effort, stop when memory runs out */
+    for(i = start; i < end; i += PGSIZE)
+        if (vma_populate_page(e, vma, i, write))
+            break;
+
+    /* Sequential access will not come back, evict what lies behind us first */
+    if (vma->advice == VMA_ADVICE_SEQUENTIAL &&
+            va >= (uint32_t) vma->va + VMA_DROPBEHIND_PAGES * PGSIZE) {
+        end = va - VMA_DROPBEHIND_PAGES * PGSIZE;
+        start = (uint32_t) vma->va;
+        if (end - start > VMA_READAHEAD_PAGES * PGSIZE)
+            start = end - VMA_READAHEAD_PAGES * PGSIZE;
+
+        for(i = start; i < end; i += PGSIZE) {
+            /* The size bit lives in the pde, in a pte bit 7 is PAT */
+            if (e->env_pgdir[PDX(i)] & PDE_BIT_HUGE)
+                continue;
+
+            pte_t *pte = pgdir_walk(e->env_pgdir, (void*) i, 0);
+            if (!pte || !(*pte & PTE_BIT_PRESENT))
+                continue;
+
+            /* Only private pages, shared ones are someone elses working set */
+            page_info_t *pp = pa2page(PTE_GET_PHYS_ADDRESS(*pte));
+            if (page_get_ref(pp) == 1 && !pp->c0.reg.kernelPage)
+                swappy_swap_page_out(pp, SWAPPY_SWAP_QUEUE | SWAPPY_SWAP_NOWAIT);
+        }
+    }
+
+    return 0;
+}
+
+int vma_advise(env_t *e, void *va, size_t len, int advice) {
+    uint32_t start = ROUNDDOWN((uint32_t) va, PGSIZE);
+    uint32_t end = ROUNDUP((uint32_t) va + len, PGSIZE);
+    uint32_t i;
+    vma_t *entry;
+
+    if (!__vma_range_mapped(e, start, end))
+        return -E_INVAL;
+
+    switch (advice) {
+        case VMA_ADVICE_NORMAL:
+        case VMA_ADVICE_SEQUENTIAL:
+        case VMA_ADVICE_RANDOM:
+            /* Persistent hint, stored per vma */
+            for(i = start; i < end;) {
+                if (!(entry = __vma_isolate(e, i, end)))
+                    return -E_NO_MEM;
+
+                entry->advice = advice;
+                i = (uint32_t) entry->va + entry->len;
+                vma_merge(e, entry);
+            }
+            return 0;
+
+        case VMA_ADVICE_WILLNEED:
+            /* Populate now, swapped pages come back on their own fault */
+            for(i = start; i < end; i += PGSIZE) {
+                entry = vma_lookup(e, (void*) i, 0);
+                if (vma_populate_page(e, entry, i, 1))
+                    return -E_NO_MEM;
+            }
+            return 0;
+
+        case VMA_ADVICE_DONTNEED:
+        case VMA_ADVICE_FREE:
+            /*
+             * Drop pages and swap slots but keep the vma's, the next access
+             * faults in a zero (or backed) page again. FREE is not lazy here.
+             * Disk pages are written first, the dirty bit goes with the pte.
+             */
+            if (vma_sync(e, (void*) start, end - start) == -E_NO_MEM)
+                return -E_NO_MEM;
+            return __dealloc_range(e, (void*) start, end - start);
+
+        default:
+            return -E_INVAL;
+    }
+}
+
+int vma_new_stack(env_t *e, void *top, size_t len, int perm) {
+    len = ROUNDUP(len, PGSIZE);
+    int i = vma_new(e, (void*)((uint32_t) top - len), len, perm, VMA_ANON);
+    if (i >= 0)
+        e->vma_list->vmas[i].flags |= VMA_FLAG_GROWSDOWN;
+    return i;
+}
+
+/**
+ * Returns the first vma which starts at or above va, 0 if there is none
+ */
+static vma_t *__vma_above(env_t *e, uint32_t va) {
+    vma_arr_t *vmar = e->vma_list;
+    uint8_t i = vmar->lowest_va_vma;
+
+    while (i != VMA_INVALID_INDEX && (uint32_t) vmar->vmas[i].va < va)
+        i = vmar->vmas[i].n_adj;
+
+    return i == VMA_INVALID_INDEX ? 0 : &vmar->vmas[i];
+}
+
+/**
+ * Lowest address a vma may claim, grow-down vma's reserve their growth room
+ */
+static uint32_t __vma_reserved_start(env_t *e, vma_t *vma) {
+    uint32_t top = (uint32_t) vma->va + vma->len;
+
+    if (!(vma->flags & VMA_FLAG_GROWSDOWN))
+        return (uint32_t) vma->va;
+    if (top < e->stack_limit + VMA_STACK_GUARD_GAP)
+        return 0;
+    return top - e->stack_limit - VMA_STACK_GUARD_GAP;
+}
+
+vma_t *vma_grow_down(env_t *e, uint32_t va) {
+    vma_t *stack = __vma_above(e, va);
+    vma_arr_t *vmar = e->vma_list;
+    uint32_t start = ROUNDDOWN(va, PGSIZE);
+
+    if (!stack || !(stack->flags & VMA_FLAG_GROWSDOWN))
+        return 0;
+
+    /* Stay within the stack limit */
+    if ((uint32_t) stack->va + stack->len - start > e->stack_limit)
+        return 0;
+
+    /* Keep the guard gap to the vma below */
+    if (stack->p_adj != VMA_INVALID_INDEX) {
+        vma_t *below = &vmar->vmas[stack->p_adj];
+        if ((uint32_t) below->va + below->len + VMA_STACK_GUARD_GAP > start)
+            return 0;
+    }
+
+    dprintf("Stack of env %d grows down to %p\n", e->env_id, start);
+    stack->len += (uint32_t) stack->va - start;
+    stack->va = (void*) start;
+
+    return stack;
+}
+
 int vma_new_range(env_t *e, size_t len, int perm, int type) {
     vma_t *cur, *next;
     uint8_t next_index;
@@ -338,8 +843,11 @@ int vma_new_range(env_t *e, size_t len, int perm, int type) {
         
         /* Check if vma_lookup found something */
         if (res==0) {
-            /* Free space for us! */
-            return vma_new(e, (void*)((uint32_t)i), len, perm ,type);
+            /* Do not take the growth room of a stack above us */
+            res = __vma_above(e, (uint32_t) i);
+            if (!res || i + len <= __vma_reserved_start(e, res))
+                /* Free space for us! */
+                return vma_new(e, (void*)((uint32_t)i), len, perm ,type);
         }
         
         /* Is in use by vma res */
@@ -355,57 +863,61 @@ int vma_new_range(env_t *e, size_t len, int perm, int type) {
 int vma_unmap(env_t *e, void *va, size_t len, int leave_pages_allocated) {
     /* assertions */
     assert(len);
-    
+
     /* Helper variables */
-    uint32_t vlen = (uint32_t) va + len;
+    uint32_t start = (uint32_t) va & 0xFFFFF000;
+    uint32_t end = ROUNDUP((uint32_t) va + len, PGSIZE);
     int dealloc = !leave_pages_allocated;
-    
-    /* Determine vma entry */
-    vma_t * entry, tmp1;
-    while((entry=vma_lookup(e, va, len))) {
-        /* This entry lies in range of va-va+len */
-        uint32_t i_vlen = (uint32_t) entry->va + entry->len;
-        
-        /* Save entry */
-        tmp1 = *entry;
-        
-        /* beginning is equal or after this entry's begin */
-        if (va >= entry->va) {
-            /* unmap, and keep beginning if va > entry->va */
-            if (va > entry->va) {
-                entry->len = (uint32_t)(va - entry->va);
-                if (dealloc) __dealloc_range(e, va, tmp1.len - entry->len);
-            }
-            else {
-                vma_remove(e, entry);
-                if (dealloc) __dealloc_range(e, entry->va, entry->len);
-            }
 
-            /* remap remainder if there is a remainder */
-            if (vlen < i_vlen) {
-                vma_new(e,(void*)vlen, i_vlen - vlen, tmp1.perm, tmp1.type);
-            }
-            
-            /* Rest this case */
+    /* Write back and unmap must not skip entries of a shared table */
+    if (__unshare_range(e, start, end))
+        return -E_NO_MEM;
+
+    /* Determine vma entry */
+    vma_t * entry;
+    while((entry=vma_lookup(e, (void*) start, end - start))) {
+        /* Keep the part before our range */
+        if ((uint32_t) entry->va < start) {
+            if (!vma_split(entry, (void*) start))
+                return -1;
             continue;
         }
-        
-        /* Tail overlaps with entry */
-        if (vlen > (uint32_t) entry->va) {
-            /* If overlap is complete, remove */
-            if (vlen >= i_vlen) {
-                vma_remove(e, entry);
-                if (dealloc) __dealloc_range(e, entry->va, entry->len);
-            }
-            else {//Else, shrink entry
-                entry->va =  (void*)vlen;
-                if (dealloc) __dealloc_range(e, tmp1.va, vlen - (uint32_t)tmp1.va);
-            }
-        }
+
+        /* Keep the part after our range */
+        if ((uint32_t) entry->va + entry->len > end)
+            if (!vma_split(entry, (void*) end))
+                return -1;
+
+        /* Entry now lies completely in range */
+        __vma_writeback(e, entry, start, end);
+        if (dealloc && __dealloc_range(e, entry->va, entry->len))
+            return -E_NO_MEM;
+        vma_remove(e, entry);
     }
     return 0;
 }
 
+int vma_sync(env_t *e, void *va, size_t len) {
+    uint32_t start = (uint32_t) va & 0xFFFFF000;
+    uint32_t end = ROUNDUP((uint32_t) va + len, PGSIZE);
+    vma_t *vma = vma_lookup(e, (void*) start, end - start);
+
+    if (!vma)
+        return -E_INVAL;
+
+    /* Cleaning a pte changes it, skipping one would lose its data */
+    if (__unshare_range(e, start, end))
+        return -E_NO_MEM;
+
+    /* Walk the sorted list from the first vma in the range */
+    while (vma && (uint32_t) vma->va < end) {
+        __vma_writeback(e, vma, start, end);
+        vma = vma->n_adj == VMA_INVALID_INDEX ? 0 : &e->vma_list->vmas[vma->n_adj];
+    }
+
+    return 0;
+}
+
 vma_t *vma_lookup(env_t *e, void *_va, size_t len) {
     /* iterate vma's till va is found to be inrange */
     
@@ -463,8 +975,12 @@ void vma_dump(vma_t * vma) {
     if (vma->type == VMA_ANON) cprintf(" anon");
     if (vma->type == VMA_BINARY) cprintf(" binary");
     if (vma->type == VMA_UNUSED) cprintf(" unused");
+    if (vma->type == VMA_SHARED) cprintf(" shared");
     cprintf("] ");
-    if (vma->backed_addr) {
+    if (vma->type == VMA_SHARED) {
+        cprintf("Object %d at offset %#08x",
+                ((shm_t*) vma->backed_addr)->id, vma->offset);
+    } else if (vma->backed_addr) {
         cprintf("Backed by: %#08x - %#08x (%#08x)", 
                 vma->backed_addr, 
                 vma->backed_addr + vma->backsize, 
@@ -10,6 +10,7 @@
 
 #include "env.h"
 #include "../inc/vma.h"
+#include "shm.h"
 
 /* VMA functions */
 /**
@@ -20,6 +21,89 @@
  */
 vma_t * vma_split(vma_t * vma, void * va);
 
+/**
+ * Merges vma with its neighbours if they are adjacent anonymous vma's
+ *  with equal permissions
+ * @param e
+ * @param vma
+ * @return the vma which now contains the given range (may be a neighbour)
+ */
+vma_t * vma_merge(env_t *e, vma_t * vma);
+
+/**
+ * Changes the permissions of all vma's in va to va+len
+ *  vma's are split at the borders of the range and merged afterwards.
+ *  The page table entries in the range are updated and the TLB is flushed once.
+ * @param e
+ * @param va
+ * @param len
+ * @param perm VMA_PERM_* flags, 0 revokes all access
+ * @return 0 on success, -E_INVAL if the range is not fully mapped,
+ *  -E_NO_MEM if no vma entries are left for the split or a page table
+ *  shared by fork could not be copied
+ */
+int vma_protect(env_t *e, void *va, size_t len, int perm);
+
+/* Pages mapped along with a fault in backed memory (aligned window) */
+#define VMA_FAULTAROUND_PAGES 4
+/* Pages mapped ahead of a fault in a sequential vma */
+#define VMA_READAHEAD_PAGES 16
+/* Distance behind a sequential fault from which pages are evicted first */
+#define VMA_DROPBEHIND_PAGES 64
+
+/* Shared zero page, mapped read only for reads of untouched anonymous memory */
+extern page_info_t *vma_zero_page;
+/* Stop sharing the zero page here, leaves headroom in pp_ref for fork */
+#define VMA_ZERO_PAGE_MAX_REF 0xF000
+
+/**
+ * Allocates the shared zero page, must be called once after mem_init
+ */
+void vma_zero_page_init();
+
+/**
+ * Returns the number of pte's currently pointing at the zero page
+ */
+uint32_t vma_zero_page_refs();
+
+/**
+ * Maps a fresh page for vma at va if nothing (present or swapped) is there
+ *  Anonymous pages are zeroed, backed pages are filled from the backing.
+ *  Reads of anonymous memory map the shared zero page instead.
+ * @param e
+ * @param vma the vma containing va
+ * @param va
+ * @param write 1 if the page is about to be written
+ * @return 0 on success or when already mapped, -E_NO_MEM on allocation failure
+ */
+int vma_populate_page(env_t *e, vma_t *vma, uint32_t va, int write);
+
+/**
+ * Handles a not-present fault in vma by mapping fault_va and, depending on
+ *  the vma advice, the pages around it. Sequential vma's additionally
+ *  queue pages far behind the fault for swap out.
+ * @param e
+ * @param vma the vma containing fault_va
+ * @param fault_va
+ * @param write 1 for a write fault
+ * @return 0 on success, -E_NO_MEM if the faulting page could not be mapped
+ */
+int vma_fault_around(env_t *e, vma_t *vma, uint32_t fault_va, int write);
+
+/**
+ * Applies a VMA_ADVICE_* hint to va to va+len
+ *  NORMAL, SEQUENTIAL and RANDOM are stored (splitting vma's as needed),
+ *  WILLNEED populates the range, DONTNEED and FREE drop all pages of the range
+ *  without unmapping the vma's.
+ * @param e
+ * @param va
+ * @param len
+ * @param advice
+ * @return 0 on success, -E_INVAL on unmapped range or unknown advice,
+ *  -E_NO_MEM if vma's could not be split or pages not be allocated
+ */
+int vma_advise(env_t *e, void *va, size_t len, int advice);
+
 /**
  * Removes specifed vma if it exists
  * @param vma
@@ -49,15 +133,45 @@ int vma_is_empty(vma_t * vma);
  */
 int vma_new(env_t *e, void *va, size_t len, int perm, int type);
 int vma_new_range(env_t *e, size_t len, int perm, int type);
+/**
+ * Creates a grow-down (stack) anonymous vma of len bytes ending at top
+ *  The vma grows on faults below it up to e->stack_limit bytes, keeping
+ *  VMA_STACK_GUARD_GAP unmapped bytes to the vma below.
+ * @param e
+ * @param top end of the stack (exclusive)
+ * @param len initial size
+ * @param perm
+ * @return index to created vma, -1 on error
+ */
+int vma_new_stack(env_t *e, void *top, size_t len, int perm);
+/**
+ * Extends the grow-down vma directly above va down to va
+ * @param e
+ * @param va faulting address below a stack
+ * @return the grown vma, 0 if there is no stack above va or the limit
+ *  or guard gap would be violated
+ */
+vma_t *vma_grow_down(env_t *e, uint32_t va);
 /**
  * unmaps vma and page_decref associated pages
  * @param e
  * @param va
  * @param len
  * @param leave_pages_allocated if 1, does NOT DECREF THE PAGES
- * @return 
+ * @return 0 on success, -1 if a vma could not be split, -E_NO_MEM if a
+ *  page table shared by fork could not be copied
  */
 int vma_unmap(env_t *e, void *va, size_t len, int leave_pages_allocated);
+/**
+ * Writes dirty pages of disk backed vma's in va to va+len back to disk
+ *  Unmapping does the same implicitly.
+ * @param e
+ * @param va
+ * @param len
+ * @return 0 on success, -E_INVAL if nothing is mapped in the range,
+ *  -E_NO_MEM if a page table shared by fork could not be copied
+ */
+int vma_sync(env_t *e, void *va, size_t len);
 /**
  * Looks up a vma table which is the first to be found in the range of va to va+len
  * @param e
@@ -119,5 +233,23 @@ int vma_get_relative(vma_t * vma1, vma_t * vma2);
  */
 void vma_set_backing(env_t* e, int vma_index, void * addr, uint32_t len);
 
+/**
+ * Set a VMA_SHARED vma to map shm starting at byte offset, takes an object
+ *  reference which is dropped when the vma is removed
+ * @param e
+ * @param vma_index
+ * @param shm
+ * @param offset page aligned offset into the object
+ */
+void vma_set_shared(env_t* e, int vma_index, shm_t *shm, uint32_t offset);
+
+/**
+ * Copies the vma list of src into dst (fork), shared objects gain a
+ *  reference for every copied vma
+ * @param dst
+ * @param src
+ */
+void vma_array_copy(env_t *dst, env_t *src);
+
 #endif /* VMA_H */
 
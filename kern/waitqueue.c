@@ -0,0 +1,85 @@
+/* Wait queues: blocking envs on events and waking them, see waitqueue.h */
+
+#include "../inc/assert.h"
+#include "../inc/atomic_ops.h"
+#include "../inc/x86.h"
+#include "waitqueue.h"
+#include "env.h"
+#include "sched.h"
+
+volatile uint32_t wait_nwaiting = 0;
+
+/* Removes e from wq, wq must be locked and hold e */
+static void wait_unlink(struct waitqueue *wq, struct env *e) {
+    struct env **link;
+
+    for (link = &wq->head; *link != e; link = &(*link)->env_wait_next)
+        assert(*link);
+    *link = e->env_wait_next;
+    if (e->env_status == ENV_WAITING_SWAP)
+        e->env_rusage.ru_swaptime += read_tsc() - e->env_charged;
+    e->env_wait_next = NULL;
+    e->env_waitq = NULL;
+    sync_sub_and_fetch(&wait_nwaiting, 1);
+}
+
+void wait_event_locked(struct waitqueue *wq, struct env *e, unsigned status) {
+    assert(!e->env_waitq && !e->env_rq);
+
+    /* Charge e while it is still ours, a waker may run it right after */
+    env_charge(e, 0);
+    e->env_rusage.ru_nvcsw++;
+    e->env_status = status;
+    e->env_waitq = wq;
+    e->env_wait_next = wq->head;
+    wq->head = e;
+    sync_add_and_fetch(&wait_nwaiting, 1);
+}
+
+void wait_event(struct waitqueue *wq, struct env *e, unsigned status) {
+    spin_lock(&wq->lock);
+    wait_event_locked(wq, e, status);
+    spin_unlock(&wq->lock);
+}
+
+int wake_up(struct waitqueue *wq) {
+    struct env *e;
+    int n = 0;
+
+    /* Lock even with no waiters: one may be between its check and queuing */
+    spin_lock(&wq->lock);
+    while ((e = wq->head)) {
+        wait_unlink(wq, e);
+        sched_wakeup(e);
+        n++;
+    }
+    spin_unlock(&wq->lock);
+
+    return n;
+}
+
+int wake_up_env(struct waitqueue *wq, struct env *e) {
+    int woken = 0;
+
+    spin_lock(&wq->lock);
+    if (e->env_waitq == wq) {
+        wait_unlink(wq, e);
+        sched_wakeup(e);
+        woken = 1;
+    }
+    spin_unlock(&wq->lock);
+
+    return woken;
+}
+
+void wait_cancel(struct env *e) {
+    struct waitqueue *wq = e->env_waitq;
+
+    if (!wq)
+        return;
+
+    spin_lock(&wq->lock);
+    if (e->env_waitq == wq)
+        wait_unlink(wq, e);
+    spin_unlock(&wq->lock);
+}
@@ -0,0 +1,62 @@
+#ifndef JOS_KERN_WAITQUEUE_H
+#define JOS_KERN_WAITQUEUE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include "../inc/env.h"
+#include "spinlock.h"
+
+/*
+ * Envs blocked on an event, owned by whatever the event belongs to (an
+ * env's exit, swap-in completion, ...). Waiters are linked through
+ * env_wait_next, so waking costs O(waiters).
+ */
+struct waitqueue {
+    struct spinlock lock;
+    struct env *head;
+};
+
+/* Number of envs blocked on any wait queue */
+extern volatile uint32_t wait_nwaiting;
+
+/**
+ * Blocks e on wq: sets its status and queues it, e is not run until woken.
+ * The caller holds wq->lock and has checked under it that the event did
+ * not happen yet, wakers take the same lock so no wakeup is lost.
+ * @param wq the wait queue, locked
+ * @param e curenv
+ * @param status ENV_WAITING or ENV_WAITING_SWAP
+ */
+void wait_event_locked(struct waitqueue *wq, struct env *e, unsigned status);
+
+/**
+ * Blocks e on wq, for events that cannot have happened yet
+ * @param wq the wait queue, unlocked
+ * @param e curenv
+ * @param status ENV_WAITING or ENV_WAITING_SWAP
+ */
+void wait_event(struct waitqueue *wq, struct env *e, unsigned status);
+
+/**
+ * Makes all envs waiting on wq runnable
+ * @param wq the wait queue, unlocked
+ * @return the number of envs woken
+ */
+int wake_up(struct waitqueue *wq);
+
+/**
+ * Makes e runnable if it waits on wq
+ * @param wq the wait queue, unlocked
+ * @param e the env
+ * @return 1 if e was woken, 0 if it did not wait on wq
+ */
+int wake_up_env(struct waitqueue *wq, struct env *e);
+
+/**
+ * Takes e off the queue it waits on without waking it (e goes away)
+ * @param e the env
+ */
+void wait_cancel(struct env *e);
+
+#endif  /* !JOS_KERN_WAITQUEUE_H */
@@ -14,3 +14,13 @@ envid_t fork(void)
     thisenv = &envs[ENVX(envid)];
     return 0;
 }
+
+/* Children started by sys_template_spawn return 0 here, like after fork */
+envid_t template_create(void)
+{
+    envid_t res = sys_template_create();
+    if (res)
+        return res;
+    thisenv = &envs[ENVX(sys_getenvid())];
+    return 0;
+}
@@ -136,6 +136,86 @@ int sys_vma_destroy(void *va, size_t size)
     return syscall(SYS_vma_destroy, 0, (uint32_t) va, size, 0, 0, 0);
 }
 
+int sys_vma_protect(void *va, size_t size, int perm)
+{
+    return syscall(SYS_vma_protect, 0, (uint32_t) va, size, perm, 0, 0);
+}
+
+int sys_vma_advise(void *va, size_t size, int advice)
+{
+    return syscall(SYS_vma_advise, 0, (uint32_t) va, size, advice, 0, 0);
+}
+
+int sys_shm_create(size_t size)
+{
+    return syscall(SYS_shm_create, 0, size, 0, 0, 0, 0);
+}
+
+void *sys_shm_map(int id, int perm)
+{
+    return (void *) syscall(SYS_shm_map, 0, id, perm, 0, 0, 0);
+}
+
+int sys_shm_destroy(int id)
+{
+    return syscall(SYS_shm_destroy, 0, id, 0, 0, 0, 0);
+}
+
+void *sys_vma_disk_map(uint32_t offset, size_t size, int perm)
+{
+    return (void *) syscall(SYS_vma_disk_map, 0, offset, size, perm, 0, 0);
+}
+
+int sys_vma_sync(void *va, size_t size)
+{
+    return syscall(SYS_vma_sync, 0, (uint32_t) va, size, 0, 0, 0);
+}
+
+envid_t sys_spawn(const char *name, const char **argv)
+{
+    return syscall(SYS_spawn, 0, (uint32_t) name, (uint32_t) argv, 0, 0, 0);
+}
+
+envid_t sys_vfork(void)
+{
+    return syscall(SYS_vfork, 0, 0, 0, 0, 0, 0);
+}
+
+int sys_exec(const char *name, const char **argv)
+{
+    return syscall(SYS_exec, 0, (uint32_t) name, (uint32_t) argv, 0, 0, 0);
+}
+
+envid_t sys_template_create(void)
+{
+    return syscall(SYS_template_create, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t sys_template_spawn(envid_t id)
+{
+    return syscall(SYS_template_spawn, 0, id, 0, 0, 0, 0);
+}
+
+int sys_set_priority(envid_t envid, int nice)
+{
+    return syscall(SYS_set_priority, 0, envid, nice, 0, 0, 0);
+}
+
+int sys_set_realtime(uint32_t runtime, uint32_t period)
+{
+    return syscall(SYS_set_realtime, 0, runtime, period, 0, 0, 0);
+}
+
+int sys_set_affinity(envid_t envid, uint32_t mask)
+{
+    return syscall(SYS_set_affinity, 0, envid, mask, 0, 0, 0);
+}
+
+int sys_getrusage(envid_t envid, struct rusage *ru)
+{
+    return syscall(SYS_getrusage, 0, envid, (uint32_t) ru, 0, 0, 0);
+}
+
 void sys_yield(void)
 {
     syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
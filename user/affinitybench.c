@@ -0,0 +1,85 @@
+/* Runs more cache hungry children than there are CPUs, first free to move
+ * between CPUs, then each pinned to one, and reports how often they
+ * migrated and how much work got done. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <inc/atomic_ops.h>
+
+#define NCHILD      4
+#define NPAGES      16      /* Working set per child */
+#define ROUNDS      200
+
+static volatile uint32_t *migrations;    /* Per child, then a done counter */
+
+/* Counts the CPUs by asking to be pinned to each of them */
+static int ncpus(void)
+{
+    int n;
+
+    for (n = 1; n < 32 && sys_set_affinity(0, 1U << n) == 0; n++)
+        ;
+    assert(sys_set_affinity(0, ~0U) == 0);
+    return n;
+}
+
+static void work(int i)
+{
+    char *buf = sys_vma_create(NPAGES * PGSIZE, PERM_R | PERM_W, 0);
+    int r, off;
+
+    assert(buf != (void *) -1);
+    for (r = 0; r < ROUNDS; r++)
+        for (off = 0; off < NPAGES * PGSIZE; off += 64)
+            buf[off]++;
+    migrations[i] = envs[ENVX(sys_getenvid())].env_migrations;
+    sync_fetch_and_add(&migrations[NCHILD], 1);
+}
+
+static uint32_t run(const char *how, int ncpu, int pin)
+{
+    envid_t child[NCHILD];
+    uint32_t total = 0;
+    uint64_t start;
+    int i;
+
+    start = read_tsc();
+    for (i = 0; i < NCHILD; i++) {
+        if ((child[i] = fork()) == 0) {
+            work(i);
+            exit();
+        }
+        assert(child[i] > 0);
+        if (pin)
+            assert(sys_set_affinity(child[i], 1U << (i % ncpu)) == 0);
+    }
+    while (migrations[NCHILD] < NCHILD)
+        sys_yield();
+    migrations[NCHILD] = 0;
+
+    for (i = 0; i < NCHILD; i++)
+        total += migrations[i];
+    cprintf("affinitybench: %-6s %5u migrations %8u rounds/Gcycle\n", how, total,
+            (uint32_t) (NCHILD * ROUNDS * 1000000000ULL / (read_tsc() - start)));
+    return total;
+}
+
+void umain(int argc, char **argv)
+{
+    int id = sys_shm_create(PGSIZE);
+    int ncpu = ncpus();
+
+    assert(id > 0);
+    migrations = sys_shm_map(id, PERM_R | PERM_W);
+    assert(migrations != (void *) -1);
+    cprintf("affinitybench: %d cpus\n", ncpu);
+
+    assert(sys_set_affinity(0, 0) == -E_INVAL);
+    run("free", ncpu, 0);
+
+    /* A pinned child moves at most once, onto its CPU */
+    assert(run("pinned", ncpu, 1) <= NCHILD);
+
+    sys_shm_destroy(id);
+    cprintf("affinitybench: ok\n");
+}
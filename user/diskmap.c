@@ -0,0 +1,64 @@
+/* Maps a range of the disk data area, writes it and checks that the data
+ * reached the disk by mapping the range again (sync and plain unmap).
+ * Two mappings of the range must see each other's writes. */
+
+#include <inc/lib.h>
+
+#define NPAGES      32
+#define TILE(I)     ((I) * PGSIZE)
+
+static void fill(char *va, int seed)
+{
+    int i;
+
+    for (i = 0; i < NPAGES; i++) {
+        va[TILE(i)] = seed + i;
+        va[TILE(i) + PGSIZE - 1] = seed - i;
+    }
+}
+
+static void check(char *va, int seed)
+{
+    int i;
+
+    for (i = 0; i < NPAGES; i++) {
+        assert(va[TILE(i)] == (char) (seed + i));
+        assert(va[TILE(i) + PGSIZE - 1] == (char) (seed - i));
+    }
+}
+
+void umain(int argc, char **argv)
+{
+    /* Contents persist between runs of the same image, use a fresh seed */
+    char *va = sys_vma_disk_map(0, TILE(NPAGES), PERM_R | PERM_W);
+    char *alias;
+    int seed;
+
+    assert(va != (void *) -1);
+    seed = va[0] + 17;
+
+    fill(va, seed);
+    assert(sys_vma_sync(va, TILE(NPAGES)) == 0);
+    sys_vma_destroy(va, TILE(NPAGES));
+
+    va = sys_vma_disk_map(0, TILE(NPAGES), PERM_R | PERM_W);
+    assert(va != (void *) -1);
+    check(va, seed);
+    cprintf("diskmap: sync ok\n");
+
+    /* Unmap writes back by itself */
+    fill(va, seed + 1);
+    sys_vma_destroy(va, TILE(NPAGES));
+    va = sys_vma_disk_map(0, TILE(NPAGES), PERM_R);
+    check(va, seed + 1);
+
+    /* A second mapping of the range shares the pages of the first */
+    alias = sys_vma_disk_map(0, TILE(NPAGES), PERM_R | PERM_W);
+    assert(alias != (void *) -1 && alias != va);
+    fill(alias, seed + 2);
+    check(va, seed + 2);
+    sys_vma_destroy(alias, TILE(NPAGES));
+    sys_vma_destroy(va, TILE(NPAGES));
+
+    cprintf("diskmap: ok\n");
+}
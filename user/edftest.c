@@ -0,0 +1,47 @@
+/* Reserves CPU time for a periodic job next to a CPU hog and checks that
+ * the job gets its time every period, then checks admission control. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define PERIOD      10000       /* Microseconds */
+#define RUNTIME     3000
+#define JOB         1000000     /* TSC cycles of work per period, within the budget */
+#define NPERIODS    50
+
+void umain(int argc, char **argv)
+{
+    const volatile struct env_rt *rt = &envs[ENVX(sys_getenvid())].env_rt;
+    uint32_t first;
+    uint64_t start;
+    envid_t hog;
+
+    if ((hog = fork()) == 0)
+        for (;;)
+            ;
+    assert(hog > 0);
+
+    assert(sys_set_realtime(PERIOD + 1, PERIOD) == -E_INVAL);
+    assert(sys_set_realtime(RUNTIME, PERIOD) == 0);
+
+    /* A change must fit on its own, a failed one keeps the old reservation */
+    assert(sys_set_realtime(PERIOD / 100 * 95, PERIOD) == -E_NO_CPU);
+    assert(rt->util == RUNTIME * 1000 / PERIOD);
+
+    /* One job per period, sys_yield waits for the next one */
+    first = rt->periods;
+    while (rt->periods - first < NPERIODS) {
+        start = read_tsc();
+        while (read_tsc() - start < JOB)
+            ;
+        sys_yield();
+    }
+    cprintf("edftest: %u periods, %u deadline misses\n",
+            rt->periods - first, rt->misses);
+    assert(rt->misses <= NPERIODS / 10);
+
+    sys_env_destroy(hog);
+    assert(sys_set_realtime(0, 0) == 0);
+    assert(rt->period == 0);
+    cprintf("edftest: ok\n");
+}
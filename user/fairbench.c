@@ -0,0 +1,59 @@
+/* Runs CPU bound children at different nice values side by side and
+ * compares the share of CPU each got with the share its weight asks for.
+ * Only meaningful when they compete for one CPU (CPUS=1). */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <inc/atomic_ops.h>
+
+#define NCHILD      3
+#define DURATION    (1ULL << 30)    /* TSC cycles the children compete */
+
+static const int nices[NCHILD] = { 0, 5, 10 };
+static const uint32_t weights[NCHILD] = { 1024, 335, 110 };
+
+void umain(int argc, char **argv)
+{
+    int id = sys_shm_create(PGSIZE);
+    uint64_t deadline, total = 0;
+    volatile uint32_t *counts;
+    uint32_t n, wtotal = 0;
+    envid_t child;
+    int i, ok = 1;
+
+    assert(id > 0);
+    counts = sys_shm_map(id, PERM_R | PERM_W);
+    assert(counts != (void *) -1);
+
+    deadline = read_tsc() + DURATION;
+    for (i = 0; i < NCHILD; i++) {
+        if ((child = fork()) == 0) {
+            assert(sys_set_priority(0, nices[i]) == 0);
+            for (n = 0; read_tsc() < deadline; n++)
+                ;
+            counts[i] = n;
+            /* Done counter after the counts, read instead of waiting */
+            sync_fetch_and_add(&counts[NCHILD], 1);
+            return;
+        }
+        assert(child > 0);
+    }
+    while (counts[NCHILD] < NCHILD)
+        sys_yield();
+
+    for (i = 0; i < NCHILD; i++) {
+        total += counts[i];
+        wtotal += weights[i];
+    }
+    for (i = 0; i < NCHILD; i++) {
+        cprintf("fairbench: nice %3d weight %4u expected %3u/1000 got %3u/1000\n",
+                nices[i], weights[i], weights[i] * 1000 / wtotal,
+                (uint32_t) (counts[i] * 1000ULL / total));
+        if (i && counts[i] >= counts[i - 1])
+            ok = 0;
+    }
+
+    assert(sys_set_priority(0, NICE_MAX + 1) == -E_INVAL);
+    cprintf(ok ? "fairbench: ok\n" : "fairbench: shares do not follow weights\n");
+    sys_shm_destroy(id);
+}
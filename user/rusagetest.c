@@ -0,0 +1,51 @@
+/* Checks that sys_getrusage accounts user and kernel time, switches and
+ * page faults of the caller. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES      8
+#define NYIELDS     10
+#define SPIN        (1ULL << 26)    /* Several time slices */
+
+void umain(int argc, char **argv)
+{
+    struct rusage before, after;
+    uint64_t start;
+    char *buf;
+    int i;
+
+    assert(sys_getrusage(0, &before) == 0);
+    assert(sys_getrusage(0, (struct rusage *) ULIM) == -E_FAULT);
+    assert(sys_getrusage(-1, &before) == -E_BAD_ENV);
+
+    /* User time, preempted at the end of each slice */
+    start = read_tsc();
+    while (read_tsc() - start < SPIN)
+        ;
+
+    for (i = 0; i < NYIELDS; i++)
+        sys_yield();
+
+    buf = sys_vma_create(NPAGES * PGSIZE, PERM_R | PERM_W, 0);
+    assert(buf != (void *) -1);
+    for (i = 0; i < NPAGES; i++)
+        buf[i * PGSIZE] = 1;
+
+    assert(sys_getrusage(0, &after) == 0);
+    cprintf("rusagetest: user %u kernel %u cycles, %u voluntary %u involuntary switches, %u faults\n",
+            (uint32_t) (after.ru_utime - before.ru_utime),
+            (uint32_t) (after.ru_stime - before.ru_stime),
+            after.ru_nvcsw - before.ru_nvcsw,
+            after.ru_nivcsw - before.ru_nivcsw,
+            after.ru_faults[PAGEFAULT_TYPE_NO_PTE] - before.ru_faults[PAGEFAULT_TYPE_NO_PTE]);
+
+    assert(after.ru_utime - before.ru_utime >= SPIN / 2);
+    assert(after.ru_stime > before.ru_stime);
+    assert(after.ru_nvcsw - before.ru_nvcsw >= NYIELDS);
+    assert(after.ru_nivcsw > before.ru_nivcsw);
+    /* Fault-around may map several pages per fault */
+    assert(after.ru_faults[PAGEFAULT_TYPE_NO_PTE] > before.ru_faults[PAGEFAULT_TYPE_NO_PTE]);
+
+    cprintf("rusagetest: ok\n");
+}
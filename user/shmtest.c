@@ -0,0 +1,54 @@
+/* Shares a memory object between parent and child (fork) and between two
+ * mappings of the same object, writes must be seen through all of them. */
+
+#include <inc/lib.h>
+
+#define NPAGES      4
+#define TILE(I)     ((I) * PGSIZE)
+
+void umain(int argc, char **argv)
+{
+    int id = sys_shm_create(TILE(NPAGES));
+    char *shm, *alias, *priv;
+    envid_t child;
+    int i;
+
+    assert(id > 0);
+    shm = sys_shm_map(id, PERM_R | PERM_W);
+    priv = sys_vma_create(PGSIZE, PERM_R | PERM_W, 0);
+    assert(shm != (void *) -1 && priv != (void *) -1);
+
+    shm[0] = 1;
+    priv[0] = 1;
+
+    if ((child = fork()) == 0) {
+        for (i = 0; i < NPAGES; i++)
+            shm[TILE(i)] = i + 2;
+        priv[0] = 42;
+        /* The handle is the parent's */
+        assert(sys_shm_destroy(id) == -E_BAD_ENV);
+        return;
+    }
+    sys_wait(child);
+
+    /* The child wrote the object in place, its private page was copied */
+    for (i = 0; i < NPAGES; i++)
+        assert(shm[TILE(i)] == i + 2);
+    assert(priv[0] == 1);
+    cprintf("shmtest: fork ok\n");
+
+    /* A second mapping aliases the same pages */
+    alias = sys_shm_map(id, PERM_R | PERM_W);
+    assert(alias != (void *) -1 && alias != shm);
+    alias[TILE(1) + 7] = 'x';
+    assert(shm[TILE(1) + 7] == 'x');
+
+    /* Mappings outlive the handle */
+    assert(sys_shm_destroy(id) == 0);
+    assert(sys_shm_map(id, PERM_R) == (void *) -1);
+    assert(shm[TILE(NPAGES - 1)] == NPAGES + 1);
+    sys_vma_destroy(alias, TILE(NPAGES));
+    sys_vma_destroy(shm, TILE(NPAGES));
+
+    cprintf("shmtest: ok\n");
+}
@@ -0,0 +1,73 @@
+/* Measures how fast short lived workers are started: fork, spawn of an
+ * embedded binary and instantiation of a template. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NWORKERS    64
+#define NHEAP       64      /* pages of parent state the workers inherit */
+
+static char *heap;
+
+static void report(const char *how, uint64_t cycles)
+{
+    uint32_t per = (uint32_t) (cycles / NWORKERS);
+
+    /* Spawns per second at 1 GHz, the TSC rate is not known here */
+    cprintf("spawnbench: %-8s %8u cycles/spawn %8u spawns/Gcycle\n",
+            how, per, (uint32_t) (1000000000ULL / per));
+}
+
+/* Waits until no worker of ours is left */
+static void reap(void)
+{
+    envid_t self = sys_getenvid();
+    int i;
+
+    for (i = 0; i < NENV; i++)
+        while (envs[i].env_parent_id == self && envs[i].env_status != ENV_FREE &&
+                envs[i].env_status != ENV_TEMPLATE)
+            sys_yield();
+}
+
+void umain(int argc, char **argv)
+{
+    const char *args[] = { "spawnbench", "worker", 0 };
+    uint64_t start;
+    envid_t tmpl;
+    int i;
+
+    if (argc == 2)
+        return;
+
+    /* Give the workers something to inherit */
+    heap = sys_vma_create(NHEAP * PGSIZE, PERM_R | PERM_W, 0);
+    assert(heap != (void *) -1);
+    for (i = 0; i < NHEAP; i++)
+        heap[i * PGSIZE] = i;
+
+    start = read_tsc();
+    for (i = 0; i < NWORKERS; i++)
+        if (fork() == 0)
+            exit();
+    report("fork", read_tsc() - start);
+    reap();
+
+    start = read_tsc();
+    for (i = 0; i < NWORKERS; i++)
+        assert(sys_spawn("spawnbench", args) > 0);
+    report("spawn", read_tsc() - start);
+    reap();
+
+    if ((tmpl = template_create()) == 0)
+        exit();
+    assert(tmpl > 0);
+    start = read_tsc();
+    for (i = 0; i < NWORKERS; i++)
+        assert(sys_template_spawn(tmpl) > 0);
+    report("template", read_tsc() - start);
+    reap();
+    sys_env_destroy(tmpl);
+
+    cprintf("spawnbench: ok\n");
+}
@@ -0,0 +1,23 @@
+/* Starts a fresh copy of itself with arguments, without forking. */
+
+#include <inc/lib.h>
+
+void umain(int argc, char **argv)
+{
+    const char *args[] = { "spawntest", "child", "42", 0 };
+    envid_t child;
+
+    if (argc == 3) {
+        assert(strcmp(argv[0], "spawntest") == 0);
+        cprintf("spawntest: child %s %s\n", argv[1], argv[2]);
+        return;
+    }
+
+    assert(sys_spawn("nosuchbinary", 0) < 0);
+
+    child = sys_spawn("spawntest", args);
+    assert(child > 0);
+    sys_wait(child);
+
+    cprintf("spawntest: ok\n");
+}
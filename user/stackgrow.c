@@ -0,0 +1,30 @@
+/* Recurses deep enough to grow the stack far beyond its initial page, then
+ * touches memory past the stack limit, which should pgflt. */
+
+#include <inc/lib.h>
+
+#define FRAME_SIZE  1024
+#define DEPTH       1024
+
+static int recurse(int depth)
+{
+    volatile char frame[FRAME_SIZE];
+
+    frame[0] = depth;
+    frame[FRAME_SIZE - 1] = depth;
+    if (depth == 0)
+        return 0;
+    return recurse(depth - 1) + frame[0] - frame[FRAME_SIZE - 1] + 1;
+}
+
+void umain(int argc, char **argv)
+{
+    volatile char *sp = (volatile char *) &argc;
+
+    assert(recurse(DEPTH) == DEPTH);
+    cprintf("stackgrow: depth %d ok\n", DEPTH);
+
+    /* Beyond the 8MB stack limit */
+    sp[-(9 * 1024 * 1024)] = 1; /* Should pgflt. */
+    cprintf("stackgrow: grew past the limit (this should not happen!!)\n");
+}
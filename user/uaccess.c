@@ -0,0 +1,40 @@
+/* Passes memory which was never touched to the kernel, the kernel copy must
+ * fault it in itself instead of rejecting it. Memory protected to no access
+ * must be rejected although the kernel could read it. */
+
+#include <inc/lib.h>
+
+#define TILE(I)     ((I) * PGSIZE)
+
+void umain(int argc, char **argv)
+{
+    const char *msg = "uaccess: lazy ok\n";
+    const char *leak = "uaccess: leaked\n";
+    char *va = sys_vma_create(TILE(2), PERM_R | PERM_W, 0);
+    char *s;
+    int n = strlen(msg);
+    envid_t child;
+
+    /* Text ends at the first page end, the second page stays untouched */
+    s = va + TILE(1) - n;
+    memcpy(s, msg, n);
+    sys_cputs(s, n + 64);
+
+    /* Nothing of the range is mapped before the call */
+    s = va + TILE(1) + 16;
+    sys_cputs(s, 32);
+    assert(s[0] == 0);
+
+    /* The page stays present without the user bit, sys_cputs kills us */
+    if ((child = fork()) == 0) {
+        strcpy(va, leak);
+        assert(sys_vma_protect(va, PGSIZE, 0) == 0);
+        sys_cputs(va, strlen(leak));
+        cprintf("uaccess: protected page survived\n");
+        exit();
+    }
+    assert(child > 0);
+    sys_wait(child);
+
+    cprintf("uaccess: ok\n");
+}
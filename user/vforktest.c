@@ -0,0 +1,82 @@
+/* The vfork child runs on our memory while we are suspended, until it
+ * exits or execs. It keeps running on it when we are destroyed meanwhile. */
+
+#include <inc/lib.h>
+
+volatile int written;
+
+struct box {
+    volatile envid_t child;
+    volatile int go;
+    volatile int done;
+};
+
+/* Counts down recursively, so the orphan uses its (inherited) stack */
+static int depth(int n)
+{
+    return n ? depth(n - 1) + 1 : 0;
+}
+
+/* A middle env vforks, we destroy it while its child still runs */
+static void orphan(void)
+{
+    int id = sys_shm_create(PGSIZE);
+    struct box *box;
+    envid_t middle;
+
+    assert(id > 0);
+    box = sys_shm_map(id, PERM_R | PERM_W);
+    assert(box != (void *) -1);
+
+    if ((middle = fork()) == 0) {
+        if (sys_vfork() == 0) {
+            box->child = sys_getenvid();
+            while (!box->go)
+                sys_yield();
+            box->done = depth(100);
+            exit();
+        }
+        exit();
+    }
+    assert(middle > 0);
+
+    while (!box->child)
+        sys_yield();
+    assert(sys_env_destroy(middle) == 0);
+    box->go = 1;
+    sys_wait(box->child);
+    assert(box->done == 100);
+
+    sys_vma_destroy(box, PGSIZE);
+    sys_shm_destroy(id);
+    cprintf("vforktest: orphan ok\n");
+}
+
+void umain(int argc, char **argv)
+{
+    const char *args[] = { "vforktest", "exec", 0 };
+    envid_t child;
+
+    if (argc == 2) {
+        cprintf("vforktest: %s ok\n", argv[1]);
+        return;
+    }
+
+    if ((child = sys_vfork()) == 0) {
+        written = 1;
+        exit();
+    }
+    assert(child > 0 && written == 1);
+
+    if ((child = sys_vfork()) == 0) {
+        written = 2;
+        sys_exec("vforktest", args);
+        panic("exec failed");
+    }
+    assert(child > 0 && written == 2);
+    sys_wait(child);
+
+    orphan();
+
+    cprintf("vforktest: ok\n");
+}
@@ -0,0 +1,36 @@
+/* Gives access pattern advice on an anonymous mapping. Dropped pages must
+ * read back as zero while the mapping itself stays usable. */
+
+#include <inc/lib.h>
+
+#define NPAGES      32
+#define TILE(I)     ((I) * PGSIZE)
+
+void umain(int argc, char **argv)
+{
+    char *va = sys_vma_create(TILE(NPAGES), PERM_R | PERM_W, 0);
+    int i;
+
+    /* Sequential sweep, faults map ahead */
+    assert(sys_vma_advise(va, TILE(NPAGES), MADV_SEQUENTIAL) == 0);
+    for (i = 0; i < NPAGES; i++)
+        va[TILE(i)] = 1;
+
+    /* Drop the second half, it reads back as zero */
+    assert(sys_vma_advise(va + TILE(NPAGES / 2), TILE(NPAGES / 2), MADV_DONTNEED) == 0);
+    for (i = 0; i < NPAGES; i++)
+        assert(va[TILE(i)] == (i < NPAGES / 2));
+    cprintf("vmaadvise: dontneed ok\n");
+
+    /* Random access on part of the range, then populate it */
+    assert(sys_vma_advise(va + TILE(4), TILE(4), MADV_RANDOM) == 0);
+    assert(sys_vma_advise(va + TILE(4), TILE(4), MADV_WILLNEED) == 0);
+    assert(va[TILE(5)] == 1);
+    assert(sys_vma_advise(va, TILE(NPAGES), MADV_FREE) == 0);
+    assert(va[TILE(5)] == 0);
+
+    /* Unmapped range and unknown advice are refused */
+    assert(sys_vma_advise(va, TILE(NPAGES + 1), MADV_NORMAL) < 0);
+    assert(sys_vma_advise(va, TILE(NPAGES), 42) < 0);
+    cprintf("vmaadvise: ok\n");
+}
@@ -0,0 +1,36 @@
+/* Changes permissions of parts of an anonymous mapping and checks that the
+ * pages follow them. The final write to a read-only page should pgflt. */
+
+#include <inc/lib.h>
+
+#define TILE(I)     ((I) * PGSIZE)
+
+void umain(int argc, char **argv)
+{
+    char *va = sys_vma_create(TILE(4), PERM_R | PERM_W, 0);
+    int i;
+
+    for (i = 0; i < 4; i++)
+        va[TILE(i)] = i;
+
+    /* Middle pages read only, outer pages stay writable */
+    assert(sys_vma_protect(va + TILE(1), TILE(2), PERM_R) == 0);
+    assert(va[TILE(1)] == 1 && va[TILE(2)] == 2);
+    va[TILE(0)] = 4;
+    va[TILE(3)] = 7;
+
+    /* Unaligned and unmapped ranges are refused */
+    assert(sys_vma_protect(va + 1, TILE(1), PERM_R) < 0);
+    assert(sys_vma_protect(va, TILE(5), PERM_R) < 0);
+
+    /* Give write access back, vma's merge again */
+    assert(sys_vma_protect(va + TILE(1), TILE(2), PERM_R | PERM_W) == 0);
+    va[TILE(1)] = 5;
+    va[TILE(2)] = 6;
+    cprintf("vmaprotect: rw ok\n");
+
+    assert(sys_vma_protect(va, TILE(4), PERM_R) == 0);
+    cprintf("vmaprotect: ro %d\n", va[TILE(2)]);
+    va[TILE(2)] = 0; /* Should pgflt. */
+    cprintf("vmaprotect: write to ro page (this should not happen!!)\n");
+}
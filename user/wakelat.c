@@ -0,0 +1,58 @@
+/* Measures how long a parent blocked in sys_wait on an otherwise idle CPU
+ * takes to run again after its child, pinned to another CPU, exits. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS     9
+#define SPIN        (1ULL << 24)    /* Child work, long enough for us to halt */
+#define MAX_LAT     (1U << 24)      /* Well below the old idle poll */
+
+static volatile uint64_t *stamp;
+
+void umain(int argc, char **argv)
+{
+    uint32_t lat[NROUNDS], t;
+    uint64_t start, end;
+    envid_t child;
+    int id, i, j;
+
+    id = sys_shm_create(PGSIZE);
+    assert(id > 0);
+    stamp = sys_shm_map(id, PERM_R | PERM_W);
+    assert(stamp != (void *) -1);
+
+    if (sys_set_affinity(0, 1) < 0 || sys_set_affinity(0, 2) < 0)
+        panic("wakelat needs two cpus");
+    assert(sys_set_affinity(0, 1) == 0);
+
+    for (i = 0; i < NROUNDS; i++) {
+        if ((child = fork()) == 0) {
+            start = read_tsc();
+            while (read_tsc() - start < SPIN)
+                ;
+            *stamp = read_tsc();
+            exit();
+        }
+        assert(child > 0);
+        assert(sys_set_affinity(child, 2) == 0);
+
+        sys_wait(child);
+        end = read_tsc();
+        lat[i] = end > *stamp ? (uint32_t) MIN(end - *stamp, ~0U) : 0;
+    }
+
+    /* Insertion sort for the median */
+    for (i = 1; i < NROUNDS; i++)
+        for (j = i; j > 0 && lat[j - 1] > lat[j]; j--) {
+            t = lat[j];
+            lat[j] = lat[j - 1];
+            lat[j - 1] = t;
+        }
+
+    cprintf("wakelat: %u wakeups, median %u cycles\n", NROUNDS, lat[NROUNDS / 2]);
+    assert(lat[NROUNDS / 2] < MAX_LAT);
+
+    sys_shm_destroy(id);
+    cprintf("wakelat: ok\n");
+}
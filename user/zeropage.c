@@ -0,0 +1,27 @@
+/* Reads untouched anonymous memory (shared zero page) and then writes to
+ * some of it, which must only change the written pages. */
+
+#include <inc/lib.h>
+
+#define NPAGES      64
+#define TILE(I)     ((I) * PGSIZE)
+
+void umain(int argc, char **argv)
+{
+    char *va = sys_vma_create(TILE(NPAGES), PERM_R | PERM_W, 0);
+    int i, sum = 0;
+
+    for (i = 0; i < TILE(NPAGES); i += 512)
+        sum += va[i];
+    assert(sum == 0);
+
+    /* Break the sharing on every other page */
+    for (i = 0; i < NPAGES; i += 2)
+        va[TILE(i) + 1] = i + 1;
+
+    for (i = 0; i < NPAGES; i++) {
+        assert(va[TILE(i)] == 0);
+        assert(va[TILE(i) + 1] == (i % 2 ? 0 : i + 1));
+    }
+    cprintf("zeropage: ok\n");
+}